@@ -0,0 +1,73 @@
+// Compares the scalar and SSE2 loops that pack colors into the hardware's format, and measures how long updateleds() takes to build a
+// whole frame. Build with "make bench" and run bin/bench-pack.
+#include "../ckb-daemon/led.h"
+#include "../ckb-daemon/keyboard.h"
+
+#define FRAMES  1000000
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Packs the three channels of a frame FRAMES times, changing one color each time so the work can't be skipped. Returns ns per frame.
+static double timepack(void (*pack)(const unsigned char*, char*), keylight* light, unsigned* checksum){
+    char r[N_KEYS / 2], g[N_KEYS / 2], b[N_KEYS / 2];
+    double start = now();
+    for(int i = 0; i < FRAMES; i++){
+        light->r[i % N_KEYS] = i;
+        pack(light->r, r);
+        pack(light->g, g);
+        pack(light->b, b);
+        *checksum += r[i % (N_KEYS / 2)] + g[0] + b[0];
+    }
+    return (now() - start) * 1e9 / FRAMES;
+}
+
+int main(){
+    keylight light;
+    for(int i = 0; i < N_KEYS; i++){
+        light.r[i] = rand();
+        light.g[i] = rand();
+        light.b[i] = rand();
+    }
+    int errors = 0;
+    unsigned checksum = 0;
+#ifdef __SSE2__
+    // Both kernels must give the same packets for every color
+    unsigned char levels[N_KEYS];
+    char scalar[N_KEYS / 2], sse2[N_KEYS / 2];
+    for(int base = 0; base < 256; base += N_KEYS){
+        for(int i = 0; i < N_KEYS; i++)
+            levels[i] = (base + i) & 0xff;
+        packscalar(levels, scalar);
+        packsse2(levels, sse2);
+        if(memcmp(scalar, sse2, sizeof(scalar))){
+            printf("Error: SSE2 kernel doesn't match the scalar loop\n");
+            errors++;
+        }
+    }
+#endif
+
+    printf("scalar:     %.1f ns/frame\n", timepack(packscalar, &light, &checksum));
+#ifdef __SSE2__
+    printf("sse2:       %.1f ns/frame\n", timepack(packsse2, &light, &checksum));
+#else
+    printf("sse2:       not available\n");
+#endif
+
+    // The whole frame as the daemon builds it. Nothing is sent, since the device has no USB queue.
+    usbdevice* kb = keyboard + 1;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+    keylight* modelight = &kb->setting.profile.currentmode->light;
+    double start = now();
+    for(int i = 0; i < FRAMES; i++){
+        modelight->r[i % N_KEYS] = i;
+        updateleds(kb);
+    }
+    printf("updateleds: %.1f ns/frame\n", (now() - start) * 1e9 / FRAMES);
+    if(!checksum)
+        printf("(checksum %u)\n", checksum);
+    return errors != 0;
+}
@@ -0,0 +1,39 @@
+// Measures how many lighting command lines per second readcmd() can parse. Each line sets every key to a different color, like a frame
+// from "ckb random". Build with "make bench" and run bin/bench-readcmd.
+#include "../ckb-daemon/devnode.h"
+#include "../ckb-daemon/keyboard.h"
+
+#define LINES   20000
+
+int main(){
+    // A device that's plugged in as far as readcmd() is concerned. Nothing is sent to it, since cmdflush() is never called.
+    usbdevice* kb = keyboard + 1;
+    kb->handle = (libusb_device_handle*)kb;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+
+    // Build the line once. readcmd() splits it in place, so each run gets a fresh copy.
+    char line[N_KEYS * 16 + 4] = "rgb";
+    int length = 3, tokens = 0;
+    for(int i = 0; i < N_KEYS; i++){
+        if(!keymap[i].name)
+            continue;
+        length += snprintf(line + length, sizeof(line) - length, " %s:%06x", keymap[i].name, (rand() & 0xffffff));
+        tokens++;
+    }
+    char copy[sizeof(line)];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int errors = 0;
+    for(int i = 0; i < LINES; i++){
+        memcpy(copy, line, length + 1);
+        errors += readcmd(kb, copy, SRC_FIFO(1));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d lines of %d tokens (%d bytes): %.0f lines/s, %.2f us/line", LINES, tokens, length, LINES / seconds, seconds * 1e6 / LINES);
+    if(errors)
+        printf(" (%d errors)", errors);
+    printf("\n");
+    return errors != 0;
+}
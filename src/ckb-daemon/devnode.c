@@ -1,7 +1,13 @@
 #include "devnode.h"
+#include "effect.h"
 #include "usb.h"
 #include "input.h"
+#include "layer.h"
 #include "led.h"
+#include "loop.h"
+#include "store.h"
+
+#include <poll.h>
 
 // OSX doesn't like putting FIFOs in /dev for some reason
 #ifndef OS_MAC
@@ -39,7 +45,7 @@ void updateconnected(){
     }
     int written = 0;
     for(int i = 1; i < DEV_MAX; i++){
-        if(keyboard[i].handle){
+        if(keyboard[i].state == DEV_LIVE){
             written = 1;
             fprintf(cfile, "%s%d %s %s\n", devpath, i, keyboard[i].setting.serial, keyboard[i].name);
         }
@@ -50,6 +56,248 @@ void updateconnected(){
     chmod(cpath, S_READ);
 }
 
+#ifdef OS_LINUX
+
+// Control socket connections
+#define CLIENT_MAX  32
+static struct {
+    int fd;
+    int device;
+} clients[CLIENT_MAX];
+
+// Creates the control socket for a device. It's optional, so failures are only warnings.
+static void makesocket(usbdevice* kb, const char* path, int index){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sock", path);
+    kb->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(kb->sock < 0 || bind(kb->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(kb->sock, 8) != 0){
+        printf("Warning: Unable to create %s: %s\n", addr.sun_path, strerror(errno));
+        if(kb->sock >= 0)
+            close(kb->sock);
+        kb->sock = 0;
+        return;
+    }
+    chmod(addr.sun_path, S_READWRITE);
+    loopadd(kb->sock, LP_SOCKET, index);
+}
+
+void sockaccept(int index){
+    usbdevice* kb = keyboard + index;
+    int fd = accept(kb->sock, 0, 0);
+    if(fd < 0)
+        return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    for(int i = 0; i < CLIENT_MAX; i++){
+        if(clients[i].fd <= 0){
+            clients[i].fd = fd;
+            clients[i].device = index;
+            loopadd(fd, LP_CLIENT, i);
+            return;
+        }
+    }
+    printf("Warning: Too many control socket connections\n");
+    close(fd);
+}
+
+static void dropclient(int client){
+    cmdrelease(SRC_CLIENT(client));
+    loopdel(clients[client].fd);
+    close(clients[client].fd);
+    clients[client].fd = 0;
+}
+
+// Largest reply to a control socket request, and the most any one query's answer can take. The last REPLY_RESERVE bytes are kept for the
+// overflow and status lines.
+#define REPLY_MAX       8192
+#define ANSWER_MAX      4096
+#define REPLY_RESERVE   64
+
+// Appends text to a reply. Returns the new length.
+static int replyadd(char* reply, int length, int size, const char* text){
+    int textlen = strlen(text);
+    if(length + textlen >= size)
+        return length;
+    memcpy(reply + length, text, textlen + 1);
+    return length + textlen;
+}
+
+int printstats(usbdevice* kb, char* buffer, int size){
+    const usbstats* stats = &kb->stats;
+    int length = snprintf(buffer, size,
+                          "sent %llu\ndropped %llu\nerrors %llu\ntimeouts %llu\nqueuemax %u\n"
+                          "frames %llu\nreplaced %llu\nfps %.1f\ninputs %llu\ninputerrors %llu\nlatency",
+                          stats->sent, stats->dropped, stats->errors, stats->timeouts, stats->queuemax,
+                          stats->frames, stats->replaced, stats->fps, stats->inputs, stats->inputerrors);
+    // Latency buckets are labeled by their upper limit in milliseconds. The last one has no limit.
+    for(int i = 0; i < LATENCY_BUCKETS && length < size; i++){
+        if(i < LATENCY_BUCKETS - 1)
+            length += snprintf(buffer + length, size - length, " <%dms:%llu", 1 << i, stats->latency[i]);
+        else
+            length += snprintf(buffer + length, size - length, " more:%llu\n", stats->latency[i]);
+    }
+    // Input latency, in microseconds
+    const latencyhist* input = &stats->inputlatency;
+    if(length < size)
+        length += snprintf(buffer + length, size - length, "inputlatency p50:%.1fus p99:%.1fus max:%.1fus\n",
+                           histpercentile(input, 0.5f) / 1000.f, histpercentile(input, 0.99f) / 1000.f, __atomic_load_n(&input->max, __ATOMIC_RELAXED) / 1000.f);
+    return (length < size ? length : size - 1);
+}
+
+void writestats(int index){
+    usbdevice* kb = keyboard + index;
+    usbstats* stats = &kb->stats;
+    long long now = monotime();
+    if(stats->updatetime)
+        stats->fps = (stats->frames - stats->updateframes) * 1000000000.f / (now - stats->updatetime);
+    stats->updatetime = now;
+    stats->updateframes = stats->frames;
+    // Write a new file and move it over the old one, so readers never see a partial update
+    char path[strlen(devpath) + 20], newpath[strlen(devpath) + 24];
+    snprintf(path, sizeof(path), "%s%d/stats", devpath, index);
+    snprintf(newpath, sizeof(newpath), "%s%d/stats.new", devpath, index);
+    char text[1024];
+    int length = printstats(kb, text, sizeof(text));
+    int fd = open(newpath, O_WRONLY | O_CREAT | O_TRUNC, S_READ);
+    if(fd < 0)
+        return;
+    int ok = (write(fd, text, length) == length);
+    close(fd);
+    if(!ok || rename(newpath, path))
+        remove(newpath);
+}
+
+// Answers a "get" query. Returns the new reply length, or -1 if the query isn't recognized.
+static int getquery(usbdevice* kb, const char* query, char* reply, int length, int size){
+    char text[32];
+    int live = (kb->state >= DEV_PROFILE);
+    if(!strcmp(query, "queue") && live){
+        // Number of USB packets waiting to be sent
+        snprintf(text, sizeof(text), "queue %d\n", usbpending(kb));
+        return replyadd(reply, length, size, text);
+    } else if(!strcmp(query, "stats") && live){
+        // Same as the stats node, but current
+        char stats[1024];
+        printstats(kb, stats, sizeof(stats));
+        return replyadd(reply, length, size, stats);
+    } else if(!strcmp(query, "rgb") && live && kb->setting.profile.currentmode){
+        // Current colors, in the same format as the rgb command
+        const keylight* light = &kb->setting.profile.currentmode->light;
+        length = replyadd(reply, length, size, light->enabled ? "rgb on" : "rgb off");
+        for(int i = 0; i < N_KEYS; i++){
+            int led = keymap[i].led;
+            if(!keymap[i].name || led < 0)
+                continue;
+            snprintf(text, sizeof(text), " %s:%02x%02x%02x", keymap[i].name, light->r[led], light->g[led], light->b[led]);
+            length = replyadd(reply, length, size, text);
+        }
+        return replyadd(reply, length, size, "\n");
+    }
+    return -1;
+}
+
+void sockread(int client){
+    int fd = clients[client].fd;
+    usbdevice* kb = keyboard + clients[client].device;
+    char request[LINE_BUFFER + 1];
+    ssize_t length = recv(fd, request, LINE_BUFFER, MSG_TRUNC);
+    if(length < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(length < 0){
+        dropclient(client);
+        return;
+    }
+    if(length == 0){
+        // An empty packet is an empty request, but recv() also returns 0 once the other side has hung up
+        struct pollfd hangup = { fd, POLLIN, 0 };
+        if(poll(&hangup, 1, 0) < 0 || (hangup.revents & (POLLHUP | POLLERR))){
+            dropclient(client);
+            return;
+        }
+    }
+    char reply[REPLY_MAX];
+    int replylen = 0;
+    reply[0] = 0;
+    int errors = 0, overflow = 0;
+    if(length > LINE_BUFFER){
+        printf("Warning: Command too long, ignoring\n");
+        errors = 1;
+    } else {
+        // Run each line of the request. Queries start with "get"; everything else goes to the command parser.
+        request[length] = 0;
+        char* line = request;
+        while(line){
+            char* next = strchr(line, '\n');
+            if(next)
+                *next++ = 0;
+            if(!strncmp(line, "get ", 4)){
+                char* query = line + 4;
+                while(*query == ' ')
+                    query++;
+                char answer[ANSWER_MAX];
+                int answerlen = getquery(kb, query, answer, 0, sizeof(answer));
+                if(answerlen < 0)
+                    errors++;
+                else if(overflow || replylen + answerlen >= REPLY_MAX - REPLY_RESERVE){
+                    // There's no room for the answer. Say so instead of cutting it off, and leave out any answers after it as well.
+                    if(!overflow)
+                        replylen = replyadd(reply, replylen, sizeof(reply), "overflow\n");
+                    overflow = 1;
+                    errors++;
+                } else
+                    replylen = replyadd(reply, replylen, sizeof(reply), answer);
+            } else if(line[0] != 0)
+                errors += readcmd(kb, line, SRC_CLIENT(client));
+            line = next;
+        }
+        cmdflush();
+    }
+    // Finish with the status
+    char status[32];
+    if(errors)
+        snprintf(status, sizeof(status), "error %d\n", errors);
+    else
+        strcpy(status, "ok\n");
+    replylen = replyadd(reply, replylen, sizeof(reply), status);
+    // Don't wait for a client that isn't reading its replies. Skipping a reply would leave it reading the wrong answers from then on, so
+    // disconnect it instead.
+    if(send(fd, reply, replylen, MSG_DONTWAIT | MSG_NOSIGNAL) < 0){
+        printf("Warning: Control socket client isn't reading replies, disconnecting it\n");
+        dropclient(client);
+    }
+}
+
+void sockclose(int index){
+    usbdevice* kb = keyboard + index;
+    for(int i = 0; i < CLIENT_MAX; i++){
+        if(clients[i].fd > 0 && clients[i].device == index)
+            dropclient(i);
+    }
+    if(kb->sock <= 0)
+        return;
+    loopdel(kb->sock);
+    close(kb->sock);
+    kb->sock = 0;
+}
+
+#else
+
+// Unix sockets on OSX don't support SOCK_SEQPACKET, so only the FIFO is available there
+static void makesocket(usbdevice* kb, const char* path, int index){
+}
+
+void sockaccept(int index){
+}
+
+void sockread(int client){
+}
+
+void sockclose(int index){
+}
+
+#endif  // OS_LINUX
+
 int makedevpath(int index){
     usbdevice* kb = keyboard + index;
     // Create the control path
@@ -64,18 +312,43 @@ int makedevpath(int index){
         printf("Error: Unable to create %s: %s\n", path, strerror(errno));
         return -1;
     }
-    // Create command FIFO
+    // Create command FIFO. It's opened for writing as well as reading so that it never reports a hangup when a client closes it
+    // (otherwise the event loop would wake up constantly)
     char fifopath[sizeof(path) + 4];
     snprintf(fifopath, sizeof(fifopath), "%s/cmd", path);
-    if(mkfifo(fifopath, S_READWRITE) != 0 || (kb->fifo = open(fifopath, O_RDONLY | O_NONBLOCK)) <= 0){
+    if(mkfifo(fifopath, S_READWRITE) != 0 || (kb->fifo = open(fifopath, O_RDWR | O_NONBLOCK)) <= 0){
         rm_recursive(path);
         printf("Error: Unable to create %s: %s\n", fifopath, strerror(errno));
         return -1;
     }
+    loopadd(kb->fifo, LP_FIFO, index);
+    makesocket(kb, path, index);
     if(kb->model == -1){
         // Root keyboard: write a list of devices
         updateconnected();
     } else {
+        // Create the binary lighting FIFO. Frames written here skip the text parser entirely.
+        char rgbpath[sizeof(path) + 9];
+        snprintf(rgbpath, sizeof(rgbpath), "%s/rgbframe", path);
+        if(mkfifo(rgbpath, S_READWRITE) != 0 || (kb->rgbfifo = open(rgbpath, O_RDWR | O_NONBLOCK)) <= 0){
+            kb->rgbfifo = 0;
+            printf("Warning: Unable to create %s: %s\n", rgbpath, strerror(errno));
+        } else
+            loopadd(kb->rgbfifo, LP_RGBFRAME, index);
+        kb->rgbsync = 1;
+        // Create the shared framebuffer
+        char fbpath[sizeof(path) + 12];
+        snprintf(fbpath, sizeof(fbpath), "%s/framebuffer", path);
+        int fbfd = open(fbpath, O_RDWR | O_CREAT | O_TRUNC, S_READWRITE);
+        if(fbfd <= 0 || ftruncate(fbfd, sizeof(ledframebuffer)) != 0){
+            printf("Warning: Unable to create %s: %s\n", fbpath, strerror(errno));
+            if(fbfd > 0)
+                close(fbfd);
+        } else {
+            chmod(fbpath, S_READWRITE);
+            kb->fbfd = fbfd;
+            kb->fbsequence = 0;
+        }
         // Write the model and serial to files (doesn't apply to root keyboard)
         char mpath[sizeof(path) + 6], spath[sizeof(path) + 7];
         snprintf(mpath, sizeof(mpath), "%s/model", path);
@@ -98,68 +371,271 @@ int makedevpath(int index){
         } else {
             printf("Warning: Unable to create %s: %s\n", spath, strerror(errno));
         }
+        // The stats are updated once per second from then on
+        writestats(index);
     }
     return 0;
 }
 
-#define MAX_LINES 512
-#define MAX_BUFFER (16 * 1024 - 1)
-int readlines(int fd, const char*** lines){
-    // Allocate static buffers to store data
-    static int buffersize = 4095;
-    static int leftover = 0, leftoverlen = 0;
-    static char* buffer = 0;
-    static const char** linebuffer = 0;
-    if(!buffer){
-        buffer = malloc(buffersize + 1);
-        linebuffer = malloc(MAX_LINES * sizeof(const char**));
-    }
-    // Move any data left over from a previous read to the start of the buffer
-    if(leftover)
-        memcpy(buffer, buffer + leftover, leftoverlen);
-    ssize_t length = read(fd, buffer + leftoverlen, buffersize - leftoverlen);
-    length = (length < 0 ? 0 : length) + leftoverlen;
-    leftover = leftoverlen = 0;
-    if(length <= 0){
-        *lines = 0;
+// Reads part of the framebuffer file. If the file has been made smaller, it's put back to its proper size. Returns 0 on success.
+static int fbread(usbdevice* kb, void* data, size_t size, off_t offset){
+    if(pread(kb->fbfd, data, size, offset) == (ssize_t)size)
         return 0;
+    printf("Warning: Framebuffer for %s (S/N: %s) was resized, restoring it\n", kb->name, kb->setting.serial);
+    if(ftruncate(kb->fbfd, sizeof(ledframebuffer)))
+        printf("Warning: Unable to restore framebuffer: %s\n", strerror(errno));
+    return -1;
+}
+
+int readframebuffer(usbdevice* kb){
+    // The file is read with pread() instead of being mapped. Any user can resize it, and a mapping would fault if the file were truncated.
+    if(!kb->fbfd)
+        return 0;
+    unsigned int sequence, after;
+    if(fbread(kb, &sequence, sizeof(sequence), offsetof(ledframebuffer, sequence)) || sequence == kb->fbsequence)
+        return 0;
+    // An odd sequence means the client is in the middle of writing. Try again on the next frame.
+    if(sequence & 1)
+        return 1;
+    // Leave the frame where it is until the hardware profile has loaded, or the load would overwrite it
+    if(kb->hwload != HW_IDLE)
+        return 1;
+    unsigned char frame[RGB_FRAME_LEN];
+    // If the sequence changed during the copy, the frame may be torn
+    if(fbread(kb, frame, RGB_FRAME_LEN, offsetof(ledframebuffer, rgb)) || fbread(kb, &after, sizeof(after), offsetof(ledframebuffer, sequence))
+            || after != sequence)
+        return 1;
+    kb->fbsequence = sequence;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(mode){
+        setledframe(mode, frame);
+        updateleds(kb);
     }
-    // Continue buffering until all available input is read or there's no room left
-    while(length == buffersize || buffersize >= MAX_BUFFER){
-        int oldsize = buffersize;
-        buffersize += 4096;
-        buffer = realloc(buffer, buffersize + 1);
-        ssize_t length2 = read(fd, buffer + oldsize, buffersize - oldsize);
-        if(length2 <= 0)
-            break;
-        length += length2;
+    return 1;
+}
+
+void readrgbframe(usbdevice* kb){
+    if(!kb->rgbfifo)
+        return;
+    // The stream has no frame marker, so a frame is only taken from a batch that can be seen to be made of whole frames. Everything in the
+    // FIFO is read at once. The batch must be a multiple of the frame size, and the one before it must have been too, or it may start
+    // partway through a frame. Anything else (a short write, or one too large to arrive in one piece) is thrown away, and the stream is
+    // known to be in step again once the FIFO has been emptied after a batch of whole frames.
+    unsigned char buffer[RGB_FRAME_LEN * 8], frame[RGB_FRAME_LEN];
+    size_t total = 0;
+    ssize_t length;
+    while((length = read(kb->rgbfifo, buffer, sizeof(buffer))) > 0){
+        // Keep the last RGB_FRAME_LEN bytes of the batch, which are the newest frame if the batch is whole
+        if(length >= RGB_FRAME_LEN)
+            memcpy(frame, buffer + length - RGB_FRAME_LEN, RGB_FRAME_LEN);
+        else {
+            memmove(frame, frame + length, RGB_FRAME_LEN - length);
+            memcpy(frame + RGB_FRAME_LEN - length, buffer, length);
+        }
+        total += length;
     }
-    buffer[length] = 0;
-    // Break the input into lines
-    char* line = buffer;
-    int nlines = 0;
-    while(1){
-        char* nextline = memchr(line, '\n', buffer + length - line);
-        if(!nextline || nlines == MAX_LINES - 1){
-            // Process any left over bytes next time
-            leftover = line - buffer;
-            leftoverlen = length - leftover;
-            break;
+    if(total == 0)
+        return;
+    int whole = (total % RGB_FRAME_LEN == 0);
+    int newframe = (whole && kb->rgbsync);
+    kb->rgbsync = whole;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(!newframe || !mode)
+        return;
+    if(kb->hwload != HW_IDLE){
+        // Show it once the hardware profile has loaded
+        memcpy(kb->heldframe, frame, RGB_FRAME_LEN);
+        kb->rgbheld = 1;
+        return;
+    }
+    setledframe(mode, frame);
+    updateleds(kb);
+}
+
+int linefill(linereader* reader, int fd){
+    if(!reader->buffer){
+        reader->buffer = malloc(LINE_BUFFER);
+        reader->start = reader->end = 0;
+        reader->skipping = 0;
+    }
+    // Move any partial line left over from the last read to the start of the buffer
+    if(reader->start > 0){
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    // If the whole buffer is one unfinished line, it's too long to be a command. Throw it away up to the next newline.
+    if(reader->end == LINE_BUFFER){
+        printf("Warning: Command too long, ignoring\n");
+        reader->end = 0;
+        reader->skipping = 1;
+    }
+    ssize_t length = read(fd, reader->buffer + reader->end, LINE_BUFFER - reader->end);
+    if(length <= 0)
+        return 0;
+    reader->end += length;
+    return length;
+}
+
+char* linenext(linereader* reader){
+    while(reader->start < reader->end){
+        char* line = reader->buffer + reader->start;
+        char* newline = memchr(line, '\n', reader->end - reader->start);
+        if(!newline)
+            return 0;
+        // Replace the \n with \0 and move past it
+        *newline = 0;
+        reader->start = newline + 1 - reader->buffer;
+        if(reader->skipping){
+            reader->skipping = 0;
+            continue;
         }
-        // Replace the \n with \0 and insert the line into the line buffer
-        *nextline = 0;
-        linebuffer[nlines++] = line;
-        line = ++nextline;
-        if(line == buffer + length)
-            break;
+        return line;
+    }
+    return 0;
+}
+
+void linefree(linereader* reader){
+    free(reader->buffer);
+    reader->buffer = 0;
+    reader->start = reader->end = 0;
+}
+
+// Looks up a command word. Returns NONE if the word isn't a command.
+static cmd getcmd(const char* word, int len){
+    // Switch on the first letter, then compare the length before the whole word
+#define MATCH(str, command) if(len == sizeof(str) - 1 && !memcmp(word, str, len)) return command
+    switch(word[0]){
+    case 'b':
+        MATCH("bind", BIND);
+        MATCH("begin", BEGIN);
+        MATCH("blend", BLEND);
+        break;
+    case 'c':
+        MATCH("commit", COMMIT);
+        break;
+    case 'd':
+        MATCH("device", DEVICE);
+        MATCH("dither", DITHER);
+        break;
+    case 'e':
+        MATCH("effect", EFFECT);
+        MATCH("erase", ERASE);
+        MATCH("eraseprofile", ERASEPROFILE);
+        break;
+    case 'h':
+        MATCH("hwload", HWLOAD);
+        MATCH("hwsave", HWSAVE);
+        break;
+    case 'l':
+        MATCH("layer", LAYER);
+        break;
+    case 'm':
+        MATCH("mode", MODE);
+        MATCH("macro", MACRO);
+        break;
+    case 'n':
+        MATCH("name", NAME);
+        break;
+    case 'o':
+        MATCH("opacity", OPACITY);
+        break;
+    case 'p':
+        MATCH("profilename", PROFILENAME);
+        break;
+    case 'r':
+        MATCH("rgb", RGB);
+        MATCH("rebind", REBIND);
+        MATCH("reactive", REACTIVE);
+        MATCH("resetlatency", RESETLATENCY);
+        break;
+    case 's':
+        MATCH("switch", SWITCH);
+        break;
+    case 'u':
+        MATCH("unbind", UNBIND);
+        break;
+    }
+#undef MATCH
+    return NONE;
+}
+
+// Finds a key by name, or by number ("#12" or "#xc"). Returns -1 if not found.
+static int getkey(const char* name, int len){
+    if(name[0] == '#'){
+        // There must be at least one digit after the prefix
+        const char* digits = name + (name[1] == 'x' ? 2 : 1);
+        char* end;
+        long keycode = strtol(digits, &end, (name[1] == 'x' ? 16 : 10));
+        if(end != digits && end == name + len && keycode >= 0 && keycode < N_KEYS)
+            return keycode;
+        return -1;
+    }
+    return findkey(name, len);
+}
+
+// Most that can be held for a device during a hardware load
+#define HELD_MAX    (LINE_BUFFER * 4)
+
+// Keeps the rest of a command line for a device that's loading its hardware profile, to be run by cmdreplay() once the load is done. The
+// mode and layer the line had selected so far are kept with it.
+static void cmdhold(usbdevice* kb, usbmode* mode, int layer, const char* rest, int source){
+    while(isspace((unsigned char)*rest))
+        rest++;
+    if(*rest == 0)
+        return;
+    char prefix[32] = "";
+    usbprofile* profile = &kb->setting.profile;
+    int length = 0;
+    if(mode && mode != profile->currentmode)
+        length += snprintf(prefix + length, sizeof(prefix) - length, "mode %d ", (int)(mode - profile->mode) + 1);
+    if(layer)
+        length += snprintf(prefix + length, sizeof(prefix) - length, "layer %d ", layer);
+    int restlen = strlen(rest);
+    int size = sizeof(int) + length + restlen + 1;
+    if(kb->heldlen + size > HELD_MAX){
+        printf("Warning: Too many commands sent to %s (S/N: %s) while loading its hardware profile, ignoring\n", kb->name, kb->setting.serial);
+        return;
     }
-    *lines = linebuffer;
-    return nlines;
+    kb->held = realloc(kb->held, kb->heldlen + size);
+    char* record = kb->held + kb->heldlen;
+    memcpy(record, &source, sizeof(int));
+    memcpy(record + sizeof(int), prefix, length);
+    memcpy(record + sizeof(int) + length, rest, restlen + 1);
+    kb->heldlen += size;
 }
 
-void readcmd(usbdevice* kb, const char* line){
-    char word[strlen(line) + 1];
-    int wordlen;
+void cmdreplay(usbdevice* kb){
+    // Take the held commands first. If one of them starts another load, whatever comes after it is held again.
+    char* held = kb->held;
+    int heldlen = kb->heldlen;
+    kb->held = 0;
+    kb->heldlen = 0;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(kb->rgbheld && mode){
+        setledframe(mode, kb->heldframe);
+        kb->ledsdirty = 1;
+    }
+    kb->rgbheld = 0;
+    for(int position = 0; position < heldlen;){
+        int source;
+        memcpy(&source, held + position, sizeof(int));
+        char* line = held + position + sizeof(int);
+        position += sizeof(int) + strlen(line) + 1;
+        readcmd(kb, line, source);
+    }
+    free(held);
+}
+
+// Runs a key command. Without a handler, the key is set on a layer instead (rgb with a layer selected).
+static void runkey(usbmode* mode, cmdhandler handler, int layer, int keyindex, const char* arg){
+    if(handler)
+        handler(mode, keyindex, arg);
+    else
+        cmd_layerrgb(mode, layer - 1, keyindex, arg);
+}
+
+int readcmd(usbdevice* kb, char* line, int source){
     // See if the first word is a serial number. If so, switch devices and skip to the next word.
     usbsetting* set = (kb->handle ? &kb->setting : 0);
     usbprofile* profile = (set ? &set->profile : 0);
@@ -167,94 +643,170 @@ void readcmd(usbdevice* kb, const char* line){
     cmd command = NONE;
     cmdhandler handler = 0;
     int rgbchange = 0;
-    // Read words from the input
-    while(sscanf(line, "%s%n", word, &wordlen) == 1){
-        line += wordlen;
+    int errors = 0;
+    // Number of words given to the effect or reactive command so far
+    int effectarg = 0;
+    // Layer used by rgb, blend, and opacity (1 is the bottom layer, 0 is the mode's own lighting)
+    int layer = 0;
+    // Commands for a device that's loading its hardware profile wait until it's done
+    if(kb && kb->hwload != HW_IDLE){
+        cmdhold(kb, mode, layer, line, source);
+        return 0;
+    }
+    // Split the input into words in place
+    while(1){
+        while(*line != 0 && isspace((unsigned char)*line))
+            line++;
+        if(*line == 0)
+            break;
+        char* word = line;
+        while(*line != 0 && !isspace((unsigned char)*line))
+            line++;
+        int wordlen = line - word;
+        if(*line != 0)
+            *line++ = 0;
         // Check for a command word
-        if(!strcmp(word, "device")){
-            command = DEVICE;
+        cmd newcommand = getcmd(word, wordlen);
+        switch(newcommand){
+        case NONE:
+            break;
+        case SWITCH:
+            command = NONE;
             handler = 0;
+            if(profile){
+                // Reactive lighting moves to the new mode, so don't leave any keys lit on the old one, and give it a layer on the new one.
+                // An effect moves too, and the new mode's layers may have been drawn over an older frame of it.
+                if(kb && profile->currentmode != mode){
+                    reactiveleave(kb);
+                    profile->currentmode = mode;
+                    reactiveclaim(kb);
+                    if(kb->effect.shown)
+                        layerdirtyall(mode);
+                }
+                profile->currentmode = mode;
+            }
+            rgbchange = 1;
             continue;
-        } else if(!strcmp(word, "mode")){
-            command = MODE;
+        case RESETLATENCY:
+            command = NONE;
             handler = 0;
+            if(kb)
+                histreset(&kb->stats.inputlatency);
             continue;
-        } else if(!strcmp(word, "switch")){
+        case BEGIN:
+            // Hold lighting updates until commit
             command = NONE;
             handler = 0;
-            if(profile)
-                profile->currentmode = mode;
-            rgbchange = 1;
+            if(kb){
+                kb->batching = source;
+                kb->batchtime = monotime();
+            }
+            continue;
+        case COMMIT:
+            // Only the connection that started the block can end it
+            command = NONE;
+            handler = 0;
+            if(kb && kb->batching == source)
+                kb->batching = 0;
             continue;
-        } else if(!strcmp(word, "hwload")){
+        case HWLOAD:
             command = NONE;
             handler = 0;
+            // The lighting is updated when the load finishes. The rest of the line has to wait until then.
             if(profile)
                 hwloadprofile(kb);
-            rgbchange = 1;
-        } else if(!strcmp(word, "hwsave")){
+            if(kb && kb->hwload != HW_IDLE){
+                cmdhold(kb, mode, layer, line, source);
+                *line = 0;
+            }
+            continue;
+        case HWSAVE:
             command = NONE;
             handler = 0;
             if(profile)
                 hwsaveprofile(kb);
-        } else if(!strcmp(word, "erase")){
+            continue;
+        case ERASE:
             command = NONE;
             handler = 0;
-            if(mode)
+            if(mode){
                 erasemode(mode);
+                // Reactive lighting's layer went with the rest
+                if(kb && mode == profile->currentmode)
+                    reactiveclaim(kb);
+            }
             rgbchange = 1;
             continue;
-        } else if(!strcmp(word, "eraseprofile")){
+        case ERASEPROFILE:
             command = NONE;
             handler = 0;
             if(profile){
                 eraseprofile(profile);
                 mode = profile->currentmode = getusbmode(0, profile);
+                if(kb)
+                    reactiveclaim(kb);
             }
             rgbchange = 1;
             continue;
-        } else if(!strcmp(word, "name")){
+        case NAME:
             command = NAME;
             handler = 0;
             if(mode)
                 updatemod(&mode->id);
             continue;
-        } else if(!strcmp(word, "profilename")){
+        case PROFILENAME:
             command = PROFILENAME;
             handler = 0;
             if(profile)
                 updatemod(&profile->id);
             continue;
-        } else if(!strcmp(word, "bind")){
+        case BIND:
             command = BIND;
             handler = cmd_bind;
             continue;
-        } else if(!strcmp(word, "unbind")){
+        case UNBIND:
             command = UNBIND;
             handler = cmd_unbind;
             continue;
-        } else if(!strcmp(word, "rebind")){
+        case REBIND:
             command = REBIND;
             handler = cmd_rebind;
             continue;
-        } else if(!strcmp(word, "macro")){
-            command = MACRO;
-            handler = 0;
-            continue;
-        } else if(!strcmp(word, "rgb")){
+        case RGB:
             command = RGB;
-            handler = cmd_ledrgb;
+            // Layers are drawn separately (see below)
+            handler = (layer ? 0 : cmd_ledrgb);
             rgbchange = 1;
             if(mode)
                 updatemod(&mode->id);
             continue;
+        case EFFECT:
+        case REACTIVE:
+            command = newcommand;
+            handler = 0;
+            effectarg = 0;
+            continue;
+        default:
+            // DEVICE, MODE, MACRO, LAYER, BLEND, OPACITY, DITHER
+            command = newcommand;
+            handler = 0;
+            continue;
         }
-        if(command == NONE)
+        if(command == NONE){
+            errors++;
             continue;
-        else if(command == DEVICE){
-            if(strlen(word) == SERIAL_LEN - 1){
+        } else if(command == DEVICE){
+            if(wordlen != SERIAL_LEN - 1)
+                errors++;
+            else {
                 usbdevice* found = findusb(word);
-                if(found){
+                if(found && found->hwload != HW_IDLE){
+                    // The device is loading its hardware profile, so hold the rest of the line for it
+                    cmdhold(found, found->setting.profile.currentmode, layer, line, source);
+                    *line = 0;
+                    kb = 0;
+                    set = 0;
+                } else if(found){
                     kb = found;
                     set = &kb->setting;
                 } else {
@@ -268,12 +820,38 @@ void readcmd(usbdevice* kb, const char* line){
             continue;
         }
         // Only the DEVICE command is valid without an existing mode
-        if(!mode)
+        if(!mode){
+            errors++;
             continue;
+        }
         if(command == MODE){
-            int newmode;
-            if(sscanf(word, "%u", &newmode) == 1 && newmode > 0 && newmode < MODE_MAX)
+            char* end;
+            long newmode = strtol(word, &end, 10);
+            if(end != word && newmode > 0 && newmode < MODE_MAX)
                 mode = getusbmode(newmode - 1, profile);
+            else
+                errors++;
+            continue;
+        } else if(command == LAYER){
+            // Layer takes a number, or "clear" to remove all of the mode's layers
+            char* end;
+            long newlayer = strtol(word, &end, 10);
+            if(!strcmp(word, "clear")){
+                closelayers(&mode->layers);
+                if(kb && mode == profile->currentmode)
+                    reactiveclaim(kb);
+                rgbchange = 1;
+            } else if(end != word && *end == 0 && newlayer >= 0 && newlayer <= LAYER_MAX)
+                layer = newlayer;
+            else
+                errors++;
+            continue;
+        } else if(command == BLEND || command == OPACITY){
+            if(!layer)
+                errors++;
+            else if(command == BLEND ? cmd_layerblend(mode, layer - 1, word) : cmd_layeropacity(mode, layer - 1, word))
+                errors++;
+            rgbchange = 1;
             continue;
         } else if(command == NAME){
             // Name just parses a whole word
@@ -285,63 +863,160 @@ void readcmd(usbdevice* kb, const char* line){
             continue;
         } else if(command == RGB){
             // RGB command has a special response for "on", "off", and a hex constant
-            int r, g, b;
             if(!strcmp(word, "on")){
                 cmd_ledon(mode);
                 continue;
             } else if(!strcmp(word, "off")){
                 cmd_ledoff(mode);
                 continue;
-            } else if(sscanf(word, "%02x%02x%02x", &r, &g, &b) == 3){
-                for(int i = 0; i < N_KEYS; i++)
-                    cmd_ledrgb(mode, i, word);
+            } else if(!(layer ? readrgba(word, 0, 0, 0, 0) : readrgb(word, 0, 0, 0))){
+                for(int i = 0; i < N_KEYS; i++){
+                    if(layer)
+                        cmd_layerrgb(mode, layer - 1, i, word);
+                    else
+                        cmd_ledrgb(mode, i, word);
+                }
                 continue;
             }
+        } else if(command == EFFECT){
+            // Effect takes a name, then up to two colors. Effects only run on devices that are plugged in.
+            int r, g, b;
+            if(!kb)
+                errors++;
+            else if(effectarg == 0){
+                if(effectstart(kb, word))
+                    errors++;
+                // Stopping an effect brings back the mode's own lighting
+                rgbchange = 1;
+            } else if(effectarg <= 2 && !readrgb(word, &r, &g, &b))
+                effectcolor(kb, effectarg, r, g, b);
+            else
+                errors++;
+            effectarg++;
+            continue;
+        } else if(command == DITHER){
+            // Dithering is on or off for the whole device
+            int dither = !strcmp(word, "on");
+            if(!kb || (!dither && strcmp(word, "off")))
+                errors++;
+            else if(kb->dither != dither){
+                kb->dither = dither;
+                memset(kb->dithererror, 0, sizeof(kb->dithererror));
+                kb->ditherqueued = 0;
+                if(dither)
+                    loopwake();
+            }
+            rgbchange = 1;
+            continue;
+        } else if(command == REACTIVE){
+            // Reactive takes a name and a color. It draws on the selected layer of the current mode, or picks one itself (see
+            // reactivestart).
+            int r, g, b;
+            if(!kb)
+                errors++;
+            else if(effectarg == 0){
+                if(reactivestart(kb, word, layer - 1))
+                    errors++;
+                rgbchange = 1;
+            } else if(effectarg == 1 && !readrgb(word, &r, &g, &b))
+                reactivecolor(kb, r, g, b);
+            else
+                errors++;
+            effectarg++;
+            continue;
         } else if(command == MACRO && !strcmp(word, "clear")){
             // Macro has a special clear command
             cmd_macroclear(mode);
             continue;
         }
-        // Split the parameter at the colon
-        int left = -1;
-        sscanf(word, "%*[^:]%n", &left);
-        if(left <= 0)
-            continue;
-        const char* right = word + left;
-        if(right[0] == ':')
-            right++;
+        // Split the parameter at the colon. A region has a colon of its own (region:x0,y0,x1,y1:value), so skip past that one.
+        int regionlen = (wordlen > 7 && !memcmp(word, "region:", 7) ? 7 : 0);
+        char* right = memchr(word + regionlen, ':', wordlen - regionlen);
+        if(right == word){
+            errors++;
+            continue;
+        }
+        int left = (right ? right - word : wordlen);
+        if(right)
+            *right++ = 0;
+        else
+            right = word + wordlen;
         // Macros have a separate left-side handler
         if(command == MACRO){
-            word[left] = 0;
             cmd_macro(mode, word, right);
             continue;
         }
+        // Layers take an alpha value as well
+        if(command == RGB && (layer ? readrgba(right, 0, 0, 0, 0) : readrgb(right, 0, 0, 0))){
+            errors++;
+            continue;
+        }
+        if(regionlen){
+            // Run the command on every key inside the rectangle
+            int x0, y0, x1, y1, end = 0;
+            if(sscanf(word + regionlen, "%d,%d,%d,%d%n", &x0, &y0, &x1, &y1, &end) != 4 || end != left - regionlen){
+                errors++;
+                continue;
+            }
+            short keys[N_KEYS];
+            int count = keysinrect(x0, y0, x1, y1, keys);
+            for(int i = 0; i < count; i++)
+                runkey(mode, handler, layer, keys[i], right);
+            continue;
+        }
         // Scan the left side for key names and run the request command
-        int position = 0, field = 0;
-        char keyname[11];
-        while(position < left && sscanf(word + position, "%10[^:,]%n", keyname, &field) == 1){
-            int keycode;
-            if(!strcmp(keyname, "all")){
+        char* keyname = word;
+        while(keyname < word + left){
+            char* comma = memchr(keyname, ',', word + left - keyname);
+            int namelen = (comma ? comma : word + left) - keyname;
+            if(namelen == 3 && !memcmp(keyname, "all", 3)){
                 // Set all keys
                 for(int i = 0; i < N_KEYS; i++)
-                    handler(mode, i, right);
-            } else if((sscanf(keyname, "#%d", &keycode) && keycode >= 0 && keycode < N_KEYS)
-                      || (sscanf(keyname, "#x%x", &keycode) && keycode >= 0 && keycode < N_KEYS)){
-                // Set a key numerically
-                handler(mode, keycode, right);
-            } else {
-                // Find this key in the keymap
-                for(unsigned i = 0; i < N_KEYS; i++){
-                    if(keymap[i].name && !strcmp(keyname, keymap[i].name)){
-                        handler(mode, i, right);
-                        break;
-                    }
-                }
+                    runkey(mode, handler, layer, i, right);
+            } else if(namelen > 0){
+                // Set a single key, either by name or by number
+                int keycode = getkey(keyname, namelen);
+                if(keycode >= 0)
+                    runkey(mode, handler, layer, keycode, right);
+                else
+                    errors++;
             }
-            if(word[position += field] == ',')
-                position++;
+            if(!comma)
+                break;
+            keyname = comma + 1;
         }
     }
-    if(mode && rgbchange)
-        updateleds(kb);
+    if(mode && rgbchange && kb)
+        kb->ledsdirty = 1;
+    if(profile)
+        storechanged();
+    return errors;
+}
+
+void cmdflush(){
+    for(int i = 1; i < DEV_MAX; i++){
+        usbdevice* kb = keyboard + i;
+        if(kb->ledsdirty && !kb->batching && kb->state >= DEV_PROFILE){
+            kb->ledsdirty = 0;
+            updateleds(kb);
+        }
+    }
+}
+
+void cmdrelease(int source){
+    long long now = monotime();
+    int released = 0;
+    for(int i = 1; i < DEV_MAX; i++){
+        usbdevice* kb = keyboard + i;
+        if(!kb->batching)
+            continue;
+        if(source ? kb->batching == source : now - kb->batchtime >= BATCH_TIMEOUT){
+            if(!source)
+                printf("Warning: Lighting on %s%d was held by begin for too long without commit\n", devpath, i);
+            kb->batching = 0;
+            released = 1;
+        }
+    }
+    if(released)
+        cmdflush();
 }
@@ -20,8 +20,35 @@ void updateconnected();
 // Create a dev path for the keyboard at index. Returns 0 on success.
 int makedevpath(int index);
 
+// Takes the latest frame from a device's shared framebuffer, if there is a new one, and updates the lighting. Returns 1 if the client
+// has changed the framebuffer since the last call, even if the frame couldn't be taken yet.
+int readframebuffer(usbdevice* kb);
+// Reads lighting frames from a device's rgbframe FIFO. Only the newest complete frame is shown; any older ones would be replaced before
+// they could be sent anyway.
+void readrgbframe(usbdevice* kb);
+
+// Writes a device's statistics as text. Returns the length written.
+int printstats(usbdevice* kb, char* buffer, int size);
+// Updates a device's stats node (ckbN/stats) and its frame rate
+void writestats(int index);
+
+// Control socket. Accepts the same commands as the FIFO, but each request (one packet, which may hold several lines) gets a reply.
+// Accepts a connection on a device's control socket
+void sockaccept(int index);
+// Reads a request from a control socket connection and sends the reply
+void sockread(int client);
+// Closes a device's control socket and all of its connections
+void sockclose(int index);
+
 // Custom readline is needed for FIFOs. fopen()/getline() will die if the data is sent in too fast.
-int readlines(int fd, const char*** lines);
+// Reads whatever is waiting on fd into the line reader. Returns the number of bytes read. Lines returned by linenext() before this call are
+// no longer valid afterward.
+int linefill(linereader* reader, int fd);
+// Gets the next complete line from the reader, without the \n. The line is kept in the reader's buffer. Returns 0 if there are no more
+// complete lines; any partial line is kept for the next linefill().
+char* linenext(linereader* reader);
+// Frees a line reader's buffer
+void linefree(linereader* reader);
 
 // Command operations
 typedef enum {
@@ -37,10 +64,41 @@ typedef enum {
     MACRO,
 
     RGB,
+    EFFECT,
+    REACTIVE,
+    DITHER,
+    RESETLATENCY,
+    LAYER,
+    BLEND,
+    OPACITY,
+
+    SWITCH,
+    HWLOAD,
+    HWSAVE,
+    ERASE,
+    ERASEPROFILE,
+    BEGIN,
+    COMMIT,
 } cmd;
 typedef void (*cmdhandler)(usbmode*, int, const char*);
 
-// Reads input from the command FIFO
-void readcmd(usbdevice* kb, const char* line);
+// Command sources. A begin/commit block belongs to the connection that started it, so that it can be ended if the connection goes away.
+#define SRC_CLIENT(index)   ((index) + 1)       // Control socket connection
+#define SRC_FIFO(index)     (-(index) - 1)      // Command FIFO of a device
+// Longest a begin/commit block may hold back lighting updates, in nanoseconds
+#define BATCH_TIMEOUT       1000000000LL
+
+// Reads input from the command FIFO. The line is split into words in place. Lighting changes aren't sent until cmdflush() is called. Returns the number of words that couldn't be used (unknown
+// commands, keys, or values). source is the connection the line came from.
+int readcmd(usbdevice* kb, char* line, int source);
+// Sends one lighting update to each device whose lighting was changed by readcmd(), unless the device is inside a begin/commit block.
+// Called after each batch of commands.
+void cmdflush();
+// Runs the commands and shows the rgbframe frame that were held while a device's hardware profile was loading. Their errors aren't
+// reported, since the request they came with has already been answered.
+void cmdreplay(usbdevice* kb);
+// Ends any begin/commit blocks started by a source (when its connection closes), or those older than BATCH_TIMEOUT if source is 0, and
+// sends the held lighting
+void cmdrelease(int source);
 
 #endif
@@ -0,0 +1,446 @@
+#include "effect.h"
+#include "keyboard.h"
+#include "layer.h"
+#include "led.h"
+#include "loop.h"
+
+#include <math.h>
+
+// Effects are timed by the clock rather than by counting frames, so they run at the same speed whatever the frame rate. A frame that comes
+// late (e.g. when the frame timer was idle) only advances the effect by this much, in seconds.
+#define MAX_STEP    0.1f
+// Width of the wave and ripple edges, in key position units
+#define EDGE        36.f
+// Duration of the gradient fade and of each random color fade, in seconds
+#define FADE_TIME   2.f
+
+// Gets the time since the last frame, in seconds, and updates lasttime. Returns 0 for the first frame.
+static float framestep(long long* lasttime){
+    long long now = monotime();
+    float dt = (*lasttime ? (now - *lasttime) / 1000000000.f : 0.f);
+    if(dt > MAX_STEP)
+        dt = MAX_STEP;
+    *lasttime = now;
+    return dt;
+}
+
+// Sends the current mode's lighting, unless it's in the middle of a begin/commit block. Then it goes out with the commit.
+static void sendframe(usbdevice* kb){
+    if(kb->batching)
+        kb->ledsdirty = 1;
+    else
+        updateleds(kb);
+}
+
+static void randomcolors(unsigned char* rgb){
+    for(int i = 0; i < RGB_FRAME_LEN; i++)
+        rgb[i] = rand() % 256;
+}
+
+int effectstart(usbdevice* kb, const char* name){
+    lighteffect* fx = &kb->effect;
+    char type;
+    if(!strcmp(name, "off") || !strcmp(name, "none"))
+        type = FX_NONE;
+    else if(!strcmp(name, "solid"))
+        type = FX_SOLID;
+    else if(!strcmp(name, "gradient"))
+        type = FX_GRADIENT;
+    else if(!strcmp(name, "wave"))
+        type = FX_WAVE;
+    else if(!strcmp(name, "ripple"))
+        type = FX_RIPPLE;
+    else if(!strcmp(name, "random"))
+        type = FX_RANDOM;
+    else
+        return -1;
+    fx->type = type;
+    // Effects draw over a copy of the mode's lighting. Keys that an effect doesn't reach keep their colors.
+    usbmode* mode = kb->setting.profile.currentmode;
+    fx->shown = (type != FX_NONE && mode);
+    if(fx->shown){
+        fx->light = mode->light;
+        fx->light.enabled = 1;
+    }
+    for(int i = 0; i < 3; i++)
+        fx->fg[i] = fx->bg[i] = 255.f;
+    fx->lasttime = 0;
+    switch(type){
+    case FX_WAVE:
+    case FX_RIPPLE:
+        fx->pos = -EDGE;
+        break;
+    case FX_GRADIENT:
+        fx->pos = 1.f;
+        break;
+    case FX_RANDOM:
+        // Start from random colors. The first frame picks new ones to fade to.
+        randomcolors(fx->to);
+        fx->pos = FADE_TIME;
+        break;
+    }
+    if(type != FX_NONE)
+        loopwake();
+    return 0;
+}
+
+void effectcolor(usbdevice* kb, int index, int r, int g, int b){
+    lighteffect* fx = &kb->effect;
+    if(index == 1){
+        fx->fg[0] = r; fx->fg[1] = g; fx->fg[2] = b;
+    }
+    fx->bg[0] = r; fx->bg[1] = g; fx->bg[2] = b;
+}
+
+// Sets a key's color in the effect's lighting
+static void setkey(lighteffect* fx, int keyindex, const unsigned char* rgb){
+    int led = keymap[keyindex].led;
+    if(led < 0 || led >= N_KEYS)
+        return;
+    fx->light.r[led] = rgb[0];
+    fx->light.g[led] = rgb[1];
+    fx->light.b[led] = rgb[2];
+}
+
+// Mixes the foreground color into the background and sets a key to it. amount is from 0 (background only) to 1 (foreground only).
+static void mix(lighteffect* fx, int keyindex, float amount){
+    unsigned char rgb[3];
+    for(int i = 0; i < 3; i++)
+        rgb[i] = fx->fg[i] * amount + fx->bg[i] * (1.f - amount);
+    setkey(fx, keyindex, rgb);
+}
+
+// Gets the distance from a key to a line (wave) or ring (ripple) at pos
+static float edgedistance(const lighteffect* fx, int keyindex, float pos){
+    int x, y;
+    getkeypos(keyindex, &x, &y);
+    float distance;
+    if(fx->type == FX_WAVE)
+        distance = x - pos;
+    else {
+        float cx = KB_WIDTH / 2.f, cy = KB_HEIGHT / 2.f;
+        distance = sqrtf((x - cx) * (x - cx) + (y - cy) * (y - cy)) - pos;
+    }
+    return (distance < 0.f ? -distance : distance);
+}
+
+// Finds the keys within EDGE units of the line or ring at pos. keys must have room for N_KEYS keys. Returns the number found.
+static int edgekeys(const lighteffect* fx, float pos, short* keys){
+    int count;
+    if(fx->type == FX_WAVE)
+        count = keysinrect(floorf(pos - EDGE), 0, ceilf(pos + EDGE), KB_HEIGHT, keys);
+    else
+        count = keysinradius(KB_WIDTH / 2.f, KB_HEIGHT / 2.f, pos + EDGE, keys);
+    // A ripple's search covers the whole circle, but only the ring is wanted
+    int found = 0;
+    for(int k = 0; k < count; k++){
+        if(edgedistance(fx, keys[k], pos) <= EDGE)
+            keys[found++] = keys[k];
+    }
+    return found;
+}
+
+// Draws a line (wave) or ring (ripple) of foreground color at fx->pos, fading into the background over EDGE units. The rest of the
+// keyboard is painted with the background on the first frame, so after that only the keys under the edge's old and new positions are
+// drawn, and only those are marked as changed in the mode's layers. Keys with no position aren't part of the picture and are left alone.
+static void drawedge(lighteffect* fx, usbmode* mode, int first, float oldpos){
+    short keys[N_KEYS];
+    if(first){
+        int x, y;
+        for(int i = 0; i < N_KEYS; i++){
+            if(!getkeypos(i, &x, &y))
+                mix(fx, i, 0.f);
+        }
+        layerdirtyall(mode);
+    } else {
+        // Put the background back where the edge was
+        int count = edgekeys(fx, oldpos, keys);
+        for(int k = 0; k < count; k++){
+            mix(fx, keys[k], 0.f);
+            layerdirty(mode, keys[k]);
+        }
+    }
+    int count = edgekeys(fx, fx->pos, keys);
+    for(int k = 0; k < count; k++){
+        mix(fx, keys[k], 1.f - edgedistance(fx, keys[k], fx->pos) / EDGE);
+        layerdirty(mode, keys[k]);
+    }
+}
+
+int effecttick(usbdevice* kb){
+    lighteffect* fx = &kb->effect;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(fx->type == FX_NONE || !mode)
+        return 0;
+    int first = (fx->lasttime == 0);
+    float dt = framestep(&fx->lasttime), oldpos = fx->pos;
+
+    switch(fx->type){
+    case FX_SOLID:
+        // Solid only needs one frame
+        for(int i = 0; i < N_KEYS; i++)
+            mix(fx, i, 1.f);
+        fx->type = FX_NONE;
+        break;
+    case FX_GRADIENT:
+        // Fade from the foreground to the background, then stop
+        fx->pos -= dt / FADE_TIME;
+        if(fx->pos <= 0.f){
+            fx->pos = 0.f;
+            fx->type = FX_NONE;
+        }
+        for(int i = 0; i < N_KEYS; i++)
+            mix(fx, i, fx->pos);
+        break;
+    case FX_WAVE:{
+        // Sweep from left to right every two seconds
+        float size = KB_WIDTH + EDGE;
+        fx->pos += (size + EDGE) / 2.f * dt;
+        if(fx->pos >= size)
+            fx->pos = -EDGE;
+        drawedge(fx, mode, first, oldpos);
+        break;
+    }
+    case FX_RIPPLE:{
+        // Expand from the center to the corners every second
+        float size = sqrtf(KB_WIDTH * KB_WIDTH / 2.f + KB_HEIGHT * KB_HEIGHT / 2.f);
+        fx->pos += (size + EDGE) * dt;
+        if(fx->pos >= size)
+            fx->pos = -EDGE;
+        drawedge(fx, mode, first, oldpos);
+        break;
+    }
+    case FX_RANDOM:{
+        // Fade every key to a new random color every two seconds
+        fx->pos += dt;
+        if(fx->pos >= FADE_TIME){
+            fx->pos = 0.f;
+            memcpy(fx->from, fx->to, RGB_FRAME_LEN);
+            randomcolors(fx->to);
+        }
+        float amount = fx->pos / FADE_TIME;
+        unsigned char rgb[3];
+        for(int i = 0; i < N_KEYS; i++){
+            for(int c = 0; c < 3; c++)
+                rgb[c] = fx->from[i * 3 + c] + (fx->to[i * 3 + c] - fx->from[i * 3 + c]) * amount;
+            setkey(fx, i, rgb);
+        }
+        break;
+    }
+    }
+
+    // The mode's layers are drawn over the effect, so they need to be drawn again. Wave and ripple have marked the keys they changed;
+    // the others change every key.
+    if(fx->type != FX_WAVE && fx->type != FX_RIPPLE)
+        layerdirtyall(mode);
+    sendframe(kb);
+    return fx->type != FX_NONE;
+}
+
+// How long a flash takes to fade out after its key is released, in seconds
+#define FLASH_TIME      0.5f
+// Ripples travel across half the keyboard in half a second, fading out as they go. The ring is about one key wide.
+#define RIPPLE_SPEED    (float)KB_WIDTH
+#define RIPPLE_SIZE     (KB_WIDTH / 2.f)
+#define RIPPLE_EDGE     12.f
+
+// Draws the reactive layer from the key levels
+static void reactivedraw(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    usbmode* mode = kb->setting.profile.currentmode;
+    for(int i = 0; i < N_KEYS; i++)
+        setlayerkey(mode, rx->layer, i, rx->color[0], rx->color[1], rx->color[2], rx->level[i] * 255.f);
+}
+
+// Sets the key levels from the ripples
+static void drawripples(reactlight* rx){
+    memset(rx->level, 0, sizeof(rx->level));
+    short keys[N_KEYS];
+    for(int r = 0; r < rx->ripplecount; r++){
+        // Only look at the keys the ring could reach
+        float radius = rx->ripple[r].radius;
+        int count = keysinradius(rx->ripple[r].x, rx->ripple[r].y, radius + RIPPLE_EDGE, keys);
+        for(int k = 0; k < count; k++){
+            int x, y;
+            getkeypos(keys[k], &x, &y);
+            float dx = x - rx->ripple[r].x, dy = y - rx->ripple[r].y;
+            float distance = sqrtf(dx * dx + dy * dy) - radius;
+            if(distance < 0.f)
+                distance = -distance;
+            if(distance >= RIPPLE_EDGE)
+                continue;
+            float ring = (1.f - distance / RIPPLE_EDGE) * (1.f - radius / RIPPLE_SIZE);
+            if(ring > rx->level[keys[k]])
+                rx->level[keys[k]] = ring;
+        }
+    }
+}
+
+// Turns off every key the reactive lighting has lit on the current mode
+static void reactiveclear(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    if(rx->type == RX_NONE || !kb->setting.profile.currentmode)
+        return;
+    memset(rx->level, 0, sizeof(rx->level));
+    rx->ripplecount = 0;
+    rx->lit = 0;
+    reactivedraw(kb);
+}
+
+void reactiveleave(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(rx->type == RX_NONE || !mode)
+        return;
+    reactiveclear(kb);
+    // A layer that was added for reactive lighting is only removed if nothing has been put above it since
+    layerstack* layers = &mode->layers;
+    if(!rx->picked && rx->layer == layers->count - 1){
+        layers->count--;
+        layerdirtyall(mode);
+    }
+}
+
+void reactiveclaim(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(rx->type == RX_NONE || !mode)
+        return;
+    if(!rx->picked)
+        rx->layer = mode->layers.count;
+    if(rx->layer >= LAYER_MAX){
+        printf("Warning: Mode has no free layer for reactive lighting, turning it off\n");
+        rx->type = RX_NONE;
+        return;
+    }
+    // Claim the layer now, so that a layer added before the first keypress doesn't end up on it too
+    getlayer(mode, rx->layer);
+}
+
+int reactivestart(usbdevice* kb, const char* name, int layer){
+    reactlight* rx = &kb->reactive;
+    char type;
+    if(!strcmp(name, "off") || !strcmp(name, "none"))
+        type = RX_NONE;
+    else if(!strcmp(name, "flash"))
+        type = RX_FLASH;
+    else if(!strcmp(name, "ripple"))
+        type = RX_RIPPLE;
+    else
+        return -1;
+    usbmode* mode = kb->setting.profile.currentmode;
+    if(!mode || layer >= LAYER_MAX)
+        return -1;
+    // Without a layer, keep the one it's already on, or else take a new one above the mode's others
+    char picked = (layer >= 0);
+    if(!picked && rx->type != RX_NONE){
+        layer = rx->layer;
+        picked = rx->picked;
+        reactiveclear(kb);
+    } else {
+        reactiveleave(kb);
+        if(!picked)
+            layer = mode->layers.count;
+    }
+    if(type != RX_NONE && layer >= LAYER_MAX)
+        return -1;
+    memset(rx, 0, sizeof(*rx));
+    rx->type = type;
+    rx->layer = layer;
+    rx->picked = picked;
+    memset(rx->color, 255, sizeof(rx->color));
+    reactiveclaim(kb);
+    return 0;
+}
+
+void reactivecolor(usbdevice* kb, int r, int g, int b){
+    reactlight* rx = &kb->reactive;
+    rx->color[0] = r;
+    rx->color[1] = g;
+    rx->color[2] = b;
+}
+
+void reactiveinput(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    if(rx->type == RX_NONE || !kb->setting.profile.currentmode)
+        return;
+    int pressed = 0;
+    for(int byte = 0; byte < N_KEYS / 8; byte++){
+        unsigned char down = kb->intinput[byte] & ~kb->previntinput[byte];
+        if(!down)
+            continue;
+        for(int bit = 0; bit < 8; bit++){
+            if(!(down & 1 << bit))
+                continue;
+            int keyindex = byte * 8 + bit, x, y;
+            pressed = 1;
+            if(rx->type == RX_FLASH)
+                rx->level[keyindex] = 1.f;
+            else if(!getkeypos(keyindex, &x, &y)){
+                // Replace the oldest ripple if there are too many
+                if(rx->ripplecount == RIPPLE_MAX){
+                    memmove(rx->ripple, rx->ripple + 1, (RIPPLE_MAX - 1) * sizeof(rx->ripple[0]));
+                    rx->ripplecount--;
+                }
+                rx->ripple[rx->ripplecount].x = x;
+                rx->ripple[rx->ripplecount].y = y;
+                rx->ripple[rx->ripplecount].radius = 0.f;
+                rx->ripplecount++;
+            }
+        }
+    }
+    if(!pressed)
+        return;
+    rx->lit = 1;
+    // Send the frame now instead of waiting for the frame timer, so the key lights up as soon as possible
+    if(rx->type == RX_RIPPLE)
+        drawripples(rx);
+    reactivedraw(kb);
+    sendframe(kb);
+    loopwake();
+}
+
+int reactivetick(usbdevice* kb){
+    reactlight* rx = &kb->reactive;
+    if(rx->type == RX_NONE || !kb->setting.profile.currentmode)
+        return 0;
+    float dt = framestep(&rx->lasttime);
+    int lit = 0;
+    if(rx->type == RX_FLASH){
+        // Keys stay lit while they're held down
+        for(int i = 0; i < N_KEYS; i++){
+            if(kb->intinput[i / 8] & 1 << (i % 8))
+                rx->level[i] = 1.f;
+            else if(rx->level[i] > 0.f){
+                rx->level[i] -= dt / FLASH_TIME;
+                if(rx->level[i] < 0.f)
+                    rx->level[i] = 0.f;
+            }
+            if(rx->level[i] > 0.f)
+                lit = 1;
+        }
+    } else {
+        int count = 0;
+        for(int r = 0; r < rx->ripplecount; r++){
+            rx->ripple[r].radius += RIPPLE_SPEED * dt;
+            if(rx->ripple[r].radius < RIPPLE_SIZE)
+                rx->ripple[count++] = rx->ripple[r];
+        }
+        rx->ripplecount = count;
+        lit = (count > 0);
+    }
+    // Between keypresses there's nothing to draw. The frame after the last key goes out is still sent, to turn it off.
+    int waslit = rx->lit;
+    rx->lit = lit;
+    if(!lit){
+        // Start timing again from the next keypress
+        rx->lasttime = 0;
+        if(!waslit)
+            return 0;
+    }
+    if(rx->type == RX_RIPPLE)
+        drawripples(rx);
+    reactivedraw(kb);
+    sendframe(kb);
+    return lit;
+}
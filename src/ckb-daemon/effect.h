@@ -0,0 +1,29 @@
+#ifndef EFFECT_H
+#define EFFECT_H
+
+#include "includes.h"
+#include "usb.h"
+
+// Starts a lighting effect by name: solid, gradient, wave, ripple, random, or off. Both colors are reset to white. Returns 0 on success.
+int effectstart(usbdevice* kb, const char* name);
+// Sets an effect color. Color 1 sets the foreground and the background, color 2 sets only the background.
+void effectcolor(usbdevice* kb, int index, int r, int g, int b);
+// Draws the next frame of the device's effect and sends it. The effect is shown in place of the current mode's lighting, which it doesn't
+// change. Returns 1 if the effect needs more frames.
+int effecttick(usbdevice* kb);
+
+// Starts reactive lighting by name (flash, ripple, or off) on one of the current mode's layers. If layer is negative, it keeps the layer it's
+// already on, or else gets a new layer above the mode's others, and gets a new one on each mode it moves to. Returns 0 on success.
+int reactivestart(usbdevice* kb, const char* name, int layer);
+void reactivecolor(usbdevice* kb, int r, int g, int b);
+// Lights up any keys that were just pressed (intinput compared to previntinput) and sends the frame right away
+void reactiveinput(usbdevice* kb);
+// Fades the reactive lighting. Returns 1 if anything is still lit.
+int reactivetick(usbdevice* kb);
+// Reactive lighting follows the current mode. Call reactiveleave() before switching modes: it turns off every key the reactive lighting
+// has lit, and removes the layer it added if nothing has been put above it. Call reactiveclaim() after switching modes, or after the
+// current mode's layers have been removed, to give it a layer on the current mode again.
+void reactiveleave(usbdevice* kb);
+void reactiveclaim(usbdevice* kb);
+
+#endif
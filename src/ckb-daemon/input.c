@@ -1,5 +1,7 @@
 #include "usb.h"
 #include "input.h"
+#include "effect.h"
+#include "loop.h"
 
 int macromask(const unsigned char* key1, const unsigned char* key2){
     // Scan a macro against key input. Return 0 if any of them don't match
@@ -10,7 +12,7 @@ int macromask(const unsigned char* key1, const unsigned char* key2){
     return 1;
 }
 
-void inputupdate(usbdevice* kb){
+void inputupdate(usbdevice* kb, long long start){
 #ifdef OS_LINUX
     if(!kb->uinput)
         return;
@@ -40,11 +42,14 @@ void inputupdate(usbdevice* kb){
             macro->triggered = 0;
         }
     }
-    // Don't do anything else if a macro was already triggered
+    // Don't do anything else if a macro was already triggered. The latency is measured up to the last event, not the lighting.
     if(macrotrigger){
+        histadd(&kb->stats.inputlatency, monotime() - start);
+        reactiveinput(kb);
         memcpy(kb->previntinput, kb->intinput, N_KEYS / 8);
         return;
     }
+    int events = 0;
     for(int byte = 0; byte < N_KEYS / 8; byte++){
         char oldb = kb->previntinput[byte], newb = kb->intinput[byte];
         if(oldb == newb)
@@ -64,18 +69,23 @@ void inputupdate(usbdevice* kb){
                     kb->intinput[byte] &= ~mask;
                 }
                 os_kpsync(kb);
+                events = 1;
             }
         }
     }
+    // Reports that don't produce any events (such as a key with no binding) aren't counted
+    if(events)
+        histadd(&kb->stats.inputlatency, monotime() - start);
+    reactiveinput(kb);
     memcpy(kb->previntinput, kb->intinput, N_KEYS / 8);
 }
 
 void updateindicators(usbdevice* kb, int force){
     // Read the indicator LEDs for this device and update them if necessary.
-    if(!kb->handle)
+    if(kb->state < DEV_PROFILE)
         return;
     if(os_readind(kb) || force)
-        libusb_control_transfer(kb->handle, 0x21, 0x09, 0x0200, 0, &kb->ileds, 1, 500);
+        usbqueueind(kb, kb->ileds);
 }
 
 void initbind(keybind* bind){
@@ -96,17 +106,14 @@ void closebind(keybind* bind){
 void cmd_bind(usbmode* mode, int keyindex, const char* to){
     // Find the key to bind to
     int tocode = 0;
-    if(sscanf(to, "#x%ux", &tocode) != 1 && sscanf(to, "#%u", &tocode) == 1){
+    if(to[0] == '#' && sscanf(to, "#x%ux", &tocode) != 1 && sscanf(to, "#%u", &tocode) == 1){
         mode->bind.base[keyindex] = tocode;
         return;
     }
     // If not numeric, look it up
-    for(int i = 0; i < N_KEYS; i++){
-        if(keymap[i].name && !strcmp(to, keymap[i].name)){
-            mode->bind.base[keyindex] = keymap[i].scan;
-            return;
-        }
-    }
+    int index = findkey(to, strlen(to));
+    if(index >= 0)
+        mode->bind.base[keyindex] = keymap[index].scan;
 }
 
 void cmd_unbind(usbmode* mode, int keyindex, const char* to){
@@ -138,12 +145,10 @@ void cmd_macro(usbmode* mode, const char* keys, const char* assignment){
             empty = 0;
         } else {
             // Find this key in the keymap
-            for(unsigned i = 0; i < N_KEYS; i++){
-                if(keymap[i].name && !strcmp(keyname, keymap[i].name)){
-                    macro.combo[i / 8] |= 1 << (i % 8);
-                    empty = 0;
-                    break;
-                }
+            int i = findkey(keyname, strlen(keyname));
+            if(i >= 0){
+                macro.combo[i / 8] |= 1 << (i % 8);
+                empty = 0;
             }
         }
         if(keys[position += field] == '+')
@@ -152,7 +157,7 @@ void cmd_macro(usbmode* mode, const char* keys, const char* assignment){
     if(empty)
         return;
     // Count the number of actions (comma separated)
-    int count = 0;
+    int count = 1;
     for(const char* c = assignment; *c != 0; c++){
         if(*c == ',')
             count++;
@@ -177,13 +182,11 @@ void cmd_macro(usbmode* mode, const char* keys, const char* assignment){
                 macro.actioncount++;
             } else {
                 // Find this key in the keymap
-                for(unsigned i = 0; i < N_KEYS; i++){
-                    if(keymap[i].name && !strcmp(keyname + 1, keymap[i].name)){
-                        macro.actions[macro.actioncount].scan = keymap[i].scan;
-                        macro.actions[macro.actioncount].down = down;
-                        macro.actioncount++;
-                        break;
-                    }
+                int i = findkey(keyname + 1, strlen(keyname + 1));
+                if(i >= 0){
+                    macro.actions[macro.actioncount].scan = keymap[i].scan;
+                    macro.actions[macro.actioncount].down = down;
+                    macro.actioncount++;
                 }
             }
         }
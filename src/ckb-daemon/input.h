@@ -9,8 +9,9 @@ int inputopen(int index, const struct libusb_device_descriptor* descriptor);
 // Closes uinput device
 void inputclose(int index);
 
-// Updates keypresses on uinput device
-void inputupdate(usbdevice* kb);
+// Updates keypresses on uinput device. start is the time the report arrived; if it produced any key events, the time from then until
+// they were written is added to the input latency histogram.
+void inputupdate(usbdevice* kb, long long start);
 // Read LEDs from the event device and update them (if needed).
 void updateindicators(usbdevice* kb, int force);
 
@@ -1,5 +1,6 @@
 #include "usb.h"
 #include "input.h"
+#include "loop.h"
 
 #ifdef OS_LINUX
 
@@ -127,6 +128,7 @@ void inputclose(int index){
     if(kb->uinput <= 0)
         return;
     printf("Closing uinput device %d\n", index);
+    loopdel(kb->event);
     close(kb->event);
     kb->event = 0;
     // Set all keys released
@@ -170,6 +172,12 @@ void os_kpsync(usbdevice* kb){
 int os_readind(usbdevice* kb){
     char ileds = 0;
     char leds[LED_CNT / 8] = { 0 };
+    // Empty the event device's queue. Reading the events isn't necessary since the LED state is fetched directly, but it
+    // needs to be done so the event loop doesn't keep waking up.
+    struct input_event events[16];
+    if(kb->event){
+        while(read(kb->event, events, sizeof(events)) > 0);
+    }
     if(kb->event && ioctl(kb->event, EVIOCGLED(sizeof(leds)), &leds))
         ileds = leds[0];
     if(ileds != kb->ileds){
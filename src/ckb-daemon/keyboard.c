@@ -294,3 +294,169 @@ key keymap[N_KEYS] = {
     { "g18",        0x8f, -1 }
 };
 #endif
+
+// Hash index of the key names, built from keymap the first time it's needed. Each slot holds a keymap index + 1, or 0 if empty. Collisions
+// go in the next free slot.
+#define KEYHASH_SIZE 512    // Must be a power of two. Keeping it well over N_KEYS keeps the probe chains short.
+static short keyhash[KEYHASH_SIZE];
+static int keyhashready = 0;
+
+// FNV-1a hash of a key name
+static unsigned hashname(const char* name, int len){
+    unsigned hash = 2166136261u;
+    for(int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+static void makekeyhash(){
+    for(int i = 0; i < N_KEYS; i++){
+        const char* name = keymap[i].name;
+        if(!name)
+            continue;
+        unsigned slot = hashname(name, strlen(name)) & (KEYHASH_SIZE - 1);
+        while(keyhash[slot])
+            slot = (slot + 1) & (KEYHASH_SIZE - 1);
+        keyhash[slot] = i + 1;
+    }
+    keyhashready = 1;
+}
+
+int findkey(const char* name, int len){
+    if(!keyhashready)
+        makekeyhash();
+    for(unsigned slot = hashname(name, len) & (KEYHASH_SIZE - 1); keyhash[slot]; slot = (slot + 1) & (KEYHASH_SIZE - 1)){
+        int index = keyhash[slot] - 1;
+        const char* keyname = keymap[index].name;
+        if(!strncmp(keyname, name, len) && keyname[len] == 0)
+            return index;
+    }
+    return -1;
+}
+
+// Key positions, measured roughly in 16th inches. Most keys are 3/4" apart.
+typedef struct {
+    const char* name;
+    short x, y;
+} keypos;
+
+#ifdef KEYMAP_UK
+static const keypos positions[] = {
+    {"mr", 38, 0}, {"m1", 50, 0}, {"m2", 62, 0}, {"m3", 74, 0}, {"light", 222, 0}, {"lock", 234, 0}, {"mute", 273, 0},
+    {"g1", 0, 14}, {"g2", 11, 14}, {"g3", 22, 14}, {"esc", 38, 14}, {"f1", 58, 14}, {"f2", 70, 14}, {"f3", 82, 14}, {"f4", 94, 14}, {"f5", 114, 14}, {"f6", 126, 14}, {"f7", 138, 14}, {"f8", 150, 14}, {"f9", 170, 14}, {"f10", 182, 14}, {"f11", 194, 14}, {"f12", 206, 14}, {"prtscn", 222, 14}, {"scroll", 234, 14}, {"pause", 246, 14}, {"stop", 262, 14}, {"prev", 273, 14}, {"play", 285, 14}, {"next", 296, 14},
+    {"g4", 0, 25}, {"g5", 11, 25}, {"g6", 22, 25}, {"grave", 38, 27}, {"1", 50, 27}, {"2", 62, 27}, {"3", 74, 27}, {"4", 86, 27}, {"5", 98, 27}, {"6", 110, 27}, {"7", 122, 27}, {"8", 134, 27}, {"9", 146, 27}, {"0", 158, 27}, {"minus", 170, 27}, {"equal", 182, 27}, {"bspace", 200, 27}, {"ins", 222, 27}, {"home", 234, 27}, {"pgup", 246, 27}, {"numlock", 261, 27}, {"numslash", 273, 27}, {"numstar", 285, 27}, {"numminus", 297, 27},
+    {"g7", 0, 39}, {"g8", 11, 39}, {"g9", 22, 39}, {"tab", 42, 39}, {"q", 56, 39}, {"w", 68, 39}, {"e", 80, 39}, {"r", 92, 39}, {"t", 104, 39}, {"y", 116, 39}, {"u", 128, 39}, {"i", 140, 39}, {"o", 152, 39}, {"p", 164, 39}, {"lbrace", 178, 39}, {"rbrace", 190, 39}, {"del", 222, 39}, {"end", 234, 39}, {"pgdn", 246, 39}, {"num7", 261, 39}, {"num8", 273, 39}, {"num9", 285, 39}, {"numplus", 297, 33},
+    {"g10", 0, 50}, {"g11", 11, 50}, {"g12", 22, 50}, {"caps", 44, 51}, {"a", 59, 51}, {"s", 71, 51}, {"d", 83, 51}, {"f", 95, 51}, {"g", 107, 51}, {"h", 119, 51}, {"j", 131, 51}, {"k", 143, 51}, {"l", 155, 51}, {"colon", 167, 51}, {"quote", 179, 51}, {"hash", 191, 51}, {"enter", 198, 51}, {"num4", 273, 51}, {"num5", 273, 51}, {"num6", 285, 51},
+    {"g13", 0, 64}, {"g14", 11, 64}, {"g15", 22, 64}, {"lshift", 46, 63}, {"bslash", 53, 63}, {"z", 65, 63}, {"x", 77, 63}, {"c", 89, 63}, {"v", 101, 63}, {"b", 113, 63}, {"n", 125, 63}, {"m", 137, 63}, {"comma", 149, 63}, {"dot", 161, 63}, {"slash", 173, 63}, {"rshift", 195, 63}, {"up", 234, 63}, {"num1", 261, 63}, {"num2", 273, 63}, {"num3", 285, 63}, {"numenter", 297, 69},
+    {"g16", 0, 75}, {"g17", 11, 75}, {"g18", 22, 75}, {"lctrl", 42, 75}, {"lwin", 56, 75}, {"lalt", 70, 75}, {"space", 122, 75}, {"ralt", 164, 75}, {"rwin", 178, 75}, {"rmenu", 190, 75}, {"rctrl", 202, 75}, {"left", 222, 75}, {"down", 234, 75}, {"right", 246, 75}, {"num0", 267, 75}, {"numdot", 285, 75},
+};
+#else
+static const keypos positions[] = {
+    {"mr", 38, 0}, {"m1", 50, 0}, {"m2", 62, 0}, {"m3", 74, 0}, {"light", 222, 0}, {"lock", 234, 0}, {"mute", 273, 0},
+    {"g1", 0, 14}, {"g2", 11, 14}, {"g3", 22, 14}, {"esc", 38, 14}, {"f1", 58, 14}, {"f2", 70, 14}, {"f3", 82, 14}, {"f4", 94, 14}, {"f5", 114, 14}, {"f6", 126, 14}, {"f7", 138, 14}, {"f8", 150, 14}, {"f9", 170, 14}, {"f10", 182, 14}, {"f11", 194, 14}, {"f12", 206, 14}, {"prtscn", 222, 14}, {"scroll", 234, 14}, {"pause", 246, 14}, {"stop", 262, 14}, {"prev", 273, 14}, {"play", 285, 14}, {"next", 296, 14},
+    {"g4", 0, 25}, {"g5", 11, 25}, {"g6", 22, 25}, {"grave", 38, 27}, {"1", 50, 27}, {"2", 62, 27}, {"3", 74, 27}, {"4", 86, 27}, {"5", 98, 27}, {"6", 110, 27}, {"7", 122, 27}, {"8", 134, 27}, {"9", 146, 27}, {"0", 158, 27}, {"minus", 170, 27}, {"equal", 182, 27}, {"bspace", 200, 27}, {"ins", 222, 27}, {"home", 234, 27}, {"pgup", 246, 27}, {"numlock", 261, 27}, {"numslash", 273, 27}, {"numstar", 285, 27}, {"numminus", 297, 27},
+    {"g7", 0, 39}, {"g8", 11, 39}, {"g9", 22, 39}, {"tab", 42, 39}, {"q", 56, 39}, {"w", 68, 39}, {"e", 80, 39}, {"r", 92, 39}, {"t", 104, 39}, {"y", 116, 39}, {"u", 128, 39}, {"i", 140, 39}, {"o", 152, 39}, {"p", 164, 39}, {"lbrace", 178, 39}, {"rbrace", 190, 39}, {"bslash", 202, 39}, {"del", 222, 39}, {"end", 234, 39}, {"pgdn", 246, 39}, {"num7", 261, 39}, {"num8", 273, 39}, {"num9", 285, 39}, {"numplus", 297, 33},
+    {"g10", 0, 50}, {"g11", 11, 50}, {"g12", 22, 50}, {"caps", 44, 51}, {"a", 59, 51}, {"s", 71, 51}, {"d", 83, 51}, {"f", 95, 51}, {"g", 107, 51}, {"h", 119, 51}, {"j", 131, 51}, {"k", 143, 51}, {"l", 155, 51}, {"colon", 167, 51}, {"quote", 179, 51}, {"enter", 198, 51}, {"num4", 273, 51}, {"num5", 273, 51}, {"num6", 285, 51},
+    {"g13", 0, 64}, {"g14", 11, 64}, {"g15", 22, 64}, {"lshift", 46, 63}, {"z", 65, 63}, {"x", 77, 63}, {"c", 89, 63}, {"v", 101, 63}, {"b", 113, 63}, {"n", 125, 63}, {"m", 137, 63}, {"comma", 149, 63}, {"dot", 161, 63}, {"slash", 173, 63}, {"rshift", 195, 63}, {"up", 234, 63}, {"num1", 261, 63}, {"num2", 273, 63}, {"num3", 285, 63}, {"numenter", 297, 69},
+    {"g16", 0, 75}, {"g17", 11, 75}, {"g18", 22, 75}, {"lctrl", 42, 75}, {"lwin", 56, 75}, {"lalt", 70, 75}, {"space", 122, 75}, {"ralt", 164, 75}, {"rwin", 178, 75}, {"rmenu", 190, 75}, {"rctrl", 202, 75}, {"left", 222, 75}, {"down", 234, 75}, {"right", 246, 75}, {"num0", 267, 75}, {"numdot", 285, 75},
+};
+#endif
+#define N_POSITIONS (sizeof(positions) / sizeof(keypos))
+
+// Key geometry, built from the table above the first time it's needed. Each key's position is -1 if it has none.
+static short keyx[N_KEYS], keyy[N_KEYS];
+static int geometryready = 0;
+// Keys with positions sorted into a grid of GRID_SIZE cells. The keys in cell c are gridkeys[gridstart[c]] to gridkeys[gridstart[c + 1] - 1].
+#define GRID_SIZE   16
+#define GRID_W      (KB_WIDTH / GRID_SIZE + 1)
+#define GRID_H      (KB_HEIGHT / GRID_SIZE + 1)
+static short gridstart[GRID_W * GRID_H + 1];
+static short gridkeys[N_KEYS];
+
+static void makegeometry(){
+    for(int i = 0; i < N_KEYS; i++)
+        keyx[i] = keyy[i] = -1;
+    for(unsigned i = 0; i < N_POSITIONS; i++){
+        int index = findkey(positions[i].name, strlen(positions[i].name));
+        if(index < 0)
+            continue;
+        keyx[index] = positions[i].x;
+        keyy[index] = positions[i].y;
+    }
+    // Count the keys in each cell, then place them
+    int cellcount[GRID_W * GRID_H] = { 0 };
+    for(int i = 0; i < N_KEYS; i++){
+        if(keyx[i] >= 0)
+            cellcount[keyy[i] / GRID_SIZE * GRID_W + keyx[i] / GRID_SIZE]++;
+    }
+    gridstart[0] = 0;
+    for(int c = 0; c < GRID_W * GRID_H; c++){
+        gridstart[c + 1] = gridstart[c] + cellcount[c];
+        cellcount[c] = gridstart[c];
+    }
+    for(int i = 0; i < N_KEYS; i++){
+        if(keyx[i] >= 0)
+            gridkeys[cellcount[keyy[i] / GRID_SIZE * GRID_W + keyx[i] / GRID_SIZE]++] = i;
+    }
+    geometryready = 1;
+}
+
+int getkeypos(int index, int* x, int* y){
+    if(!geometryready)
+        makegeometry();
+    if(index < 0 || index >= N_KEYS || keyx[index] < 0)
+        return -1;
+    *x = keyx[index];
+    *y = keyy[index];
+    return 0;
+}
+
+// Gets the range of grid cells covering a rectangle. Returns 0 if the rectangle is off the grid.
+static int gridrange(float x0, float y0, float x1, float y1, int* cx0, int* cy0, int* cx1, int* cy1){
+    if(x1 < 0.f || y1 < 0.f || x0 > KB_WIDTH || y0 > KB_HEIGHT || x0 > x1 || y0 > y1)
+        return 0;
+    *cx0 = (x0 < 0.f ? 0 : (int)x0 / GRID_SIZE);
+    *cy0 = (y0 < 0.f ? 0 : (int)y0 / GRID_SIZE);
+    *cx1 = (x1 >= KB_WIDTH ? GRID_W - 1 : (int)x1 / GRID_SIZE);
+    *cy1 = (y1 >= KB_HEIGHT ? GRID_H - 1 : (int)y1 / GRID_SIZE);
+    return 1;
+}
+
+int keysinrect(int x0, int y0, int x1, int y1, short* keys){
+    if(!geometryready)
+        makegeometry();
+    int cx0, cy0, cx1, cy1, count = 0;
+    if(!gridrange(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1))
+        return 0;
+    for(int cy = cy0; cy <= cy1; cy++){
+        for(int cx = cx0; cx <= cx1; cx++){
+            int cell = cy * GRID_W + cx;
+            for(int k = gridstart[cell]; k < gridstart[cell + 1]; k++){
+                int key = gridkeys[k];
+                if(keyx[key] >= x0 && keyx[key] <= x1 && keyy[key] >= y0 && keyy[key] <= y1)
+                    keys[count++] = key;
+            }
+        }
+    }
+    return count;
+}
+
+int keysinradius(float x, float y, float r, short* keys){
+    if(!geometryready)
+        makegeometry();
+    int cx0, cy0, cx1, cy1, count = 0;
+    if(!gridrange(x - r, y - r, x + r, y + r, &cx0, &cy0, &cx1, &cy1))
+        return 0;
+    for(int cy = cy0; cy <= cy1; cy++){
+        for(int cx = cx0; cx <= cx1; cx++){
+            int cell = cy * GRID_W + cx;
+            for(int k = gridstart[cell]; k < gridstart[cell + 1]; k++){
+                int key = gridkeys[k];
+                float dx = keyx[key] - x, dy = keyy[key] - y;
+                if(dx * dx + dy * dy <= r * r)
+                    keys[count++] = key;
+            }
+        }
+    }
+    return count;
+}
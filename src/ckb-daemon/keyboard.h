@@ -16,4 +16,17 @@ typedef struct {
 // List of keys, ordered according to where they appear in the keyboard input
 extern key keymap[N_KEYS];
 
+// Finds a key by name (len characters, not necessarily null-terminated). Returns its index in keymap, or -1 if not found.
+int findkey(const char* name, int len);
+
+// Keyboard size. Key positions are measured in roughly 16ths of an inch, starting from the top left.
+#define KB_WIDTH    298
+#define KB_HEIGHT   76
+// Gets a key's position. Returns 0 on success, or -1 if the key has no known position.
+int getkeypos(int index, int* x, int* y);
+// Finds the keys whose positions are inside a rectangle (including the edges) or a circle. keys must have room for N_KEYS keys. Returns
+// the number of keys found. Only the part of the keyboard that overlaps the area is searched.
+int keysinrect(int x0, int y0, int x1, int y1, short* keys);
+int keysinradius(float x, float y, float r, short* keys);
+
 #endif
@@ -0,0 +1,191 @@
+#include "layer.h"
+#include "led.h"
+
+keylayer* getlayer(usbmode* mode, int index){
+    layerstack* layers = &mode->layers;
+    if(index < 0 || index >= LAYER_MAX)
+        return 0;
+    if(index < layers->count)
+        return layers->layer + index;
+    if(!layers->layer)
+        layers->layer = malloc(LAYER_MAX * sizeof(keylayer));
+    for(int i = layers->count; i <= index; i++){
+        memset(layers->layer[i].rgba, 0, sizeof(layers->layer[i].rgba));
+        layers->layer[i].opacity = 255;
+        layers->layer[i].blend = BLEND_ALPHA;
+    }
+    if(layers->count == 0){
+        // The composite hasn't been kept up to date without layers, so it all needs to be redone
+        layers->count = index + 1;
+        layerdirtyall(mode);
+    } else
+        layers->count = index + 1;
+    return layers->layer + index;
+}
+
+void closelayers(layerstack* layers){
+    free(layers->layer);
+    memset(layers, 0, sizeof(*layers));
+}
+
+void layerdirty(usbmode* mode, int keyindex){
+    layerstack* layers = &mode->layers;
+    if(layers->count == 0)
+        return;
+    layers->dirty[keyindex / 8] |= 1 << (keyindex % 8);
+    layers->anydirty = 1;
+}
+
+void layerdirtyall(usbmode* mode){
+    layerstack* layers = &mode->layers;
+    if(layers->count == 0)
+        return;
+    // LEDs with no key never get composited, so they're copied as they are when the layers are next drawn. That has to wait until then,
+    // since the lighting they're drawn over isn't known until then either.
+    layers->reset = 1;
+    memset(layers->dirty, 0xff, sizeof(layers->dirty));
+    layers->anydirty = 1;
+}
+
+void setlayerkey(usbmode* mode, int index, int keyindex, int r, int g, int b, int a){
+    keylayer* layer = getlayer(mode, index);
+    if(!layer)
+        return;
+    unsigned char* rgba = layer->rgba[keyindex];
+    if(rgba[0] == r && rgba[1] == g && rgba[2] == b && rgba[3] == a)
+        return;
+    rgba[0] = r;
+    rgba[1] = g;
+    rgba[2] = b;
+    rgba[3] = a;
+    layerdirty(mode, keyindex);
+}
+
+// Divides 0 to 255 * 255 by 255 without a division. Compositing is mostly this.
+#define DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+
+// Mixes c into below by amount (0 to 255)
+static int mix(int below, int c, int amount){
+    return (c > below ? below + DIV255((c - below) * amount) : below - DIV255((below - c) * amount));
+}
+
+// Draws one key of a layer over a color
+static void blendkey(const keylayer* layer, const unsigned char* rgba, int* color){
+    if(rgba[3] == 0)
+        return;
+    // Alpha scaled by the layer's opacity, from 0 to 255
+    int a = DIV255(rgba[3] * layer->opacity);
+    for(int i = 0; i < 3; i++){
+        int c = rgba[i], below = color[i];
+        switch(layer->blend){
+        case BLEND_REPLACE:
+            // Alpha only masks the key here, so only the layer's opacity mixes the colors
+            color[i] = mix(below, c, layer->opacity);
+            break;
+        case BLEND_ALPHA:
+            color[i] = mix(below, c, a);
+            break;
+        case BLEND_ADD:
+            color[i] = below + DIV255(c * a);
+            if(color[i] > 255)
+                color[i] = 255;
+            break;
+        case BLEND_MULTIPLY:
+            color[i] = DIV255(below * (255 - DIV255((255 - c) * a)));
+            break;
+        }
+    }
+}
+
+const keylight* layerflatten(usbmode* mode, const keylight* base){
+    layerstack* layers = &mode->layers;
+    if(layers->count == 0)
+        return base;
+    // If the layers were last drawn over something else, all of them need to be drawn again
+    if(layers->base != base){
+        layerdirtyall(mode);
+        layers->base = base;
+    }
+    if(layers->reset){
+        layers->composite = *base;
+        layers->reset = 0;
+    }
+    layers->composite.enabled = base->enabled;
+    if(!layers->anydirty)
+        return &layers->composite;
+    const keylight* light = base;
+    keylight* composite = &layers->composite;
+    for(int byte = 0; byte < N_KEYS / 8; byte++){
+        if(!layers->dirty[byte])
+            continue;
+        for(int bit = 0; bit < 8; bit++){
+            if(!(layers->dirty[byte] & 1 << bit))
+                continue;
+            int key = byte * 8 + bit;
+            int led = keymap[key].led;
+            if(led < 0 || led >= N_KEYS)
+                continue;
+            int color[3] = { light->r[led], light->g[led], light->b[led] };
+            for(int i = 0; i < layers->count; i++)
+                blendkey(layers->layer + i, layers->layer[i].rgba[key], color);
+            composite->r[led] = color[0];
+            composite->g[led] = color[1];
+            composite->b[led] = color[2];
+        }
+        layers->dirty[byte] = 0;
+    }
+    layers->anydirty = 0;
+    return composite;
+}
+
+void cmd_layerrgb(usbmode* mode, int index, int keyindex, const char* code){
+    int r, g, b, a;
+    if(readrgba(code, &r, &g, &b, &a))
+        return;
+    setlayerkey(mode, index, keyindex, r, g, b, a);
+}
+
+// Marks every key used by a layer as changed
+static void layerdirtykeys(usbmode* mode, const keylayer* layer){
+    for(int i = 0; i < N_KEYS; i++){
+        if(layer->rgba[i][3])
+            layerdirty(mode, i);
+    }
+}
+
+int cmd_layerblend(usbmode* mode, int index, const char* name){
+    char blend;
+    if(!strcmp(name, "replace"))
+        blend = BLEND_REPLACE;
+    else if(!strcmp(name, "alpha"))
+        blend = BLEND_ALPHA;
+    else if(!strcmp(name, "add"))
+        blend = BLEND_ADD;
+    else if(!strcmp(name, "multiply"))
+        blend = BLEND_MULTIPLY;
+    else
+        return -1;
+    keylayer* layer = getlayer(mode, index);
+    if(!layer)
+        return -1;
+    if(layer->blend != blend){
+        layer->blend = blend;
+        layerdirtykeys(mode, layer);
+    }
+    return 0;
+}
+
+int cmd_layeropacity(usbmode* mode, int index, const char* value){
+    char* end;
+    long opacity = strtol(value, &end, 10);
+    if(end == value || *end != 0 || opacity < 0 || opacity > 255)
+        return -1;
+    keylayer* layer = getlayer(mode, index);
+    if(!layer)
+        return -1;
+    if(layer->opacity != opacity){
+        layer->opacity = opacity;
+        layerdirtykeys(mode, layer);
+    }
+    return 0;
+}
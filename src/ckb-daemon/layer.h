@@ -0,0 +1,28 @@
+#ifndef LAYER_H
+#define LAYER_H
+
+#include "includes.h"
+#include "usb.h"
+
+// Gets one of a mode's lighting layers (0 is the bottom), adding empty layers up to it if needed. New layers are transparent, fully opaque,
+// and use BLEND_ALPHA. Returns null if index is out of range.
+keylayer* getlayer(usbmode* mode, int index);
+// Frees a mode's layers
+void closelayers(layerstack* layers);
+// Sets a key's color and alpha in a layer
+void setlayerkey(usbmode* mode, int index, int keyindex, int r, int g, int b, int a);
+// Marks a key as changed in the mode's own lighting, or all keys
+void layerdirty(usbmode* mode, int keyindex);
+void layerdirtyall(usbmode* mode);
+// Gets the lighting to show for a mode, with its layers drawn over base (normally the mode's own lighting). If the mode has layers, any keys
+// that changed are composited again first. Keys that change in base must be marked with layerdirty() unless base is the mode's lighting.
+const keylight* layerflatten(usbmode* mode, const keylight* base);
+
+// Sets a key's color in a layer (RRGGBB or RRGGBBAA)
+void cmd_layerrgb(usbmode* mode, int index, int keyindex, const char* code);
+// Sets a layer's blend mode by name (replace, alpha, add, multiply). Returns 0 on success.
+int cmd_layerblend(usbmode* mode, int index, const char* name);
+// Sets a layer's opacity (0 to 255). Returns 0 on success.
+int cmd_layeropacity(usbmode* mode, int index, const char* value);
+
+#endif
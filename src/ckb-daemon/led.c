@@ -1,16 +1,75 @@
 #include "led.h"
+#include "layer.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void initrgb(keylight* light){
     // Allocate colors. Default to all white.
     light->enabled = 1;
-    memset(light->r, 0, sizeof(light->r));
-    memset(light->g, 0, sizeof(light->g));
-    memset(light->b, 0, sizeof(light->b));
+    memset(light->r, 255, sizeof(light->r));
+    memset(light->g, 255, sizeof(light->g));
+    memset(light->b, 255, sizeof(light->b));
+}
+
+void packscalar(const unsigned char* in, char* out){
+    for(int i = 0; i < N_KEYS; i += 2)
+        out[i / 2] = (7 - (in[i] >> 5)) | (7 - (in[i + 1] >> 5)) << 4;
+}
+
+#ifdef __SSE2__
+void packsse2(const unsigned char* in, char* out){
+    const __m128i ones = _mm_set1_epi8(-1), seven = _mm_set1_epi8(7), low = _mm_set1_epi16(0x00ff);
+    for(int i = 0; i < N_KEYS; i += 16){
+        __m128i c = _mm_loadu_si128((const __m128i*)(in + i));
+        // 7 - (c >> 5) is the same as (~c >> 5) & 7. The shift is done on 16-bit lanes, so mask off what crosses over from the high byte.
+        __m128i n = _mm_and_si128(_mm_srli_epi16(_mm_xor_si128(c, ones), 5), seven);
+        // Each 16-bit lane now holds an even LED in the low byte and an odd LED in the high byte. Move the odd one down to bits 4-7.
+        n = _mm_or_si128(_mm_and_si128(n, low), _mm_srli_epi16(n, 4));
+        _mm_storel_epi64((__m128i*)(out + i / 2), _mm_packus_epi16(n, n));
+    }
 }
+#endif
 
-void makergb(const keylight* light, unsigned char data_pkt[5][MSG_SIZE]){
+// Packs one color channel into the hardware format. The compiler doesn't vectorize the scalar loop, so SSE2 is used where it's available.
+static void packchannel(const unsigned char* in, char* out){
+#ifdef __SSE2__
+    packsse2(in, out);
+#else
+    packscalar(in, out);
+#endif
+}
+
+// Rounds a color to one of the hardware's 8 levels, carrying the rounding error over to the next frame. error is in 255ths of a level.
+static int ditherlevel(int c, short* error){
+    int value = c * 7 + *error;
+    int level = (value + 127) / 255;
+    if(level > 7)
+        level = 7;
+    *error = value - level * 255;
+    return level;
+}
+
+// Packs a color channel like packchannel, but with temporal dithering so that the colors average out to their 8-bit values over time
+static void ditherchannel(const unsigned char* in, short* error, char* out){
+    for(int i = 0; i < N_KEYS; i += 2)
+        out[i / 2] = (7 - ditherlevel(in[i], error + i)) | (7 - ditherlevel(in[i + 1], error + i + 1)) << 4;
+}
+
+// Builds the lighting packets for a set of colors. If error isn't null, the colors are dithered.
+static void makergb(const keylight* light, unsigned char data_pkt[5][MSG_SIZE], short (*error)[N_KEYS]){
     if(light->enabled){
-        const char* r = light->r, *g = light->g, *b = light->b;
+        char r[N_KEYS / 2], g[N_KEYS / 2], b[N_KEYS / 2];
+        if(error){
+            ditherchannel(light->r, error[0], r);
+            ditherchannel(light->g, error[1], g);
+            ditherchannel(light->b, error[2], b);
+        } else {
+            packchannel(light->r, r);
+            packchannel(light->g, g);
+            packchannel(light->b, b);
+        }
         memcpy(data_pkt[0] + 4, r, 60);
         memcpy(data_pkt[1] + 4, r + 60, 12);
         memcpy(data_pkt[1] + 16, g, 48);
@@ -37,8 +96,29 @@ void updateleds(usbdevice* kb){
         { 0x07, 0x27, 0x00, 0x00, 0xD8 }
     };
 
-    makergb(&kb->setting.profile.currentmode->light, data_pkt);
-    usbqueue(kb, data_pkt[0], 5);
+    // A running effect is shown in place of the mode's own lighting
+    usbmode* mode = kb->setting.profile.currentmode;
+    const keylight* base = (kb->effect.shown ? &kb->effect.light : &mode->light);
+    const keylight* light = layerflatten(mode, base);
+    if(!kb->dither){
+        makergb(light, data_pkt, 0);
+        usbqueueframe(kb, data_pkt);
+        return;
+    }
+    // The error from a dithered frame only carries over once the frame has been taken for sending. If it's still waiting, this frame
+    // replaces it, so start again from the frame before. (If it's taken between this check and the new frame being queued, one frame's
+    // error is lost, which only makes the dithering very slightly less accurate.)
+    if(kb->ditherqueued && !usbframewaiting(kb)){
+        memcpy(kb->dithererror, kb->ditherpending, sizeof(kb->dithererror));
+        kb->ditherqueued = 0;
+    }
+    short error[3][N_KEYS];
+    memcpy(error, kb->dithererror, sizeof(error));
+    makergb(light, data_pkt, error);
+    // A frame that's skipped because it's the same as the last one still counts, since the device goes on showing those colors
+    usbqueueframe(kb, data_pkt);
+    memcpy(kb->ditherpending, error, sizeof(error));
+    kb->ditherqueued = 1;
 }
 
 void saveleds(usbdevice* kb, int mode){
@@ -50,8 +130,10 @@ void saveleds(usbdevice* kb, int mode){
         { 0x07, 0x14, 0x02, 0x00, 0x01, mode + 1 }
     };
 
-    makergb(&kb->setting.profile.mode[mode].light, data_pkt);
+    makergb(&kb->setting.profile.mode[mode].light, data_pkt, 0);
     usbqueue(kb, data_pkt[0], 5);
+    // The colors go through the device's LED buffer, so it no longer holds the last frame. Send the next one even if it's the same.
+    kb->lastvalid = 0;
 }
 
 void loadleds(usbdevice* kb, int mode){
@@ -62,28 +144,41 @@ void loadleds(usbdevice* kb, int mode){
         { 0xff, 0x03, 0x3c, 0 },
         { 0xff, 0x04, 0x24, 0 },
     };
-    usbqueue(kb, data_pkt[0], 1);
-    usleep(3333);
-    usbdequeue(kb);
-    for(int i = 1; i < 5; i++){
-        usbqueue(kb, data_pkt[i], 1);
-        usleep(3333);
-        usbdequeue(kb);
-        // Wait for the response
-        libusb_control_transfer(kb->handle, 0xa1, 1, 0x0300, 0x03, data_pkt[i], MSG_SIZE, 500);
+    usbqueuereq(kb, data_pkt[0], 0);
+    for(int i = 1; i < 5; i++)
+        usbqueuereq(kb, data_pkt[i], HWT_LEDS | mode << 4 | i);
+    // This overwrites the device's LED buffer, so it no longer holds the last frame. Send the next one even if it's the same.
+    kb->lastvalid = 0;
+}
+
+// Expands packed LED levels (see packchannel) back to 8-bit colors. count is the number of bytes, so twice as many LEDs are written.
+static void unpackchannel(const unsigned char* in, int count, unsigned char* out){
+    for(int i = 0; i < count; i++){
+        out[i * 2] = (7 - (in[i] & 7)) * 255 / 7;
+        out[i * 2 + 1] = (7 - (in[i] >> 4 & 7)) * 255 / 7;
     }
-    // Copy the data back to the mode
-    keylight* light = &kb->setting.profile.mode[mode].light;
-    char* r = light->r, *g = light->g, *b = light->b;
-    memcpy(r, data_pkt[1] + 4, 60);
-    memcpy(r + 60, data_pkt[2] + 4, 12);
-    memcpy(g, data_pkt[2] + 16, 48);
-    memcpy(g + 48, data_pkt[3] + 4, 24);
-    memcpy(b, data_pkt[3] + 28, 36);
-    memcpy(b + 36, data_pkt[4] + 4, 36);
 }
 
-#define MAX_WORDS 3
+void loadledpacket(keylight* light, int packet, const unsigned char* data){
+    // Copy the data back to the mode
+    unsigned char* r = light->r, *g = light->g, *b = light->b;
+    switch(packet){
+    case 1:
+        unpackchannel(data + 4, 60, r);
+        break;
+    case 2:
+        unpackchannel(data + 4, 12, r + 120);
+        unpackchannel(data + 16, 48, g);
+        break;
+    case 3:
+        unpackchannel(data + 4, 24, g + 96);
+        unpackchannel(data + 28, 36, b);
+        break;
+    case 4:
+        unpackchannel(data + 4, 36, b + 72);
+        break;
+    }
+}
 
 void cmd_ledoff(usbmode* mode){
     mode->light.enabled = 0;
@@ -93,27 +188,87 @@ void cmd_ledon(usbmode* mode){
     mode->light.enabled = 1;
 }
 
+// Gets the value of a hex digit, or -1 if it isn't one
+static int hexdigit(char c){
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Reads count hex bytes into value. Returns 0 on success.
+static int readhex(const char* code, int count, int* value){
+    for(int i = 0; i < count; i++){
+        int high = hexdigit(code[i * 2]), low = (high < 0 ? -1 : hexdigit(code[i * 2 + 1]));
+        if(low < 0)
+            return -1;
+        value[i] = high << 4 | low;
+    }
+    return 0;
+}
+
+int readrgb(const char* code, int* r, int* g, int* b){
+    return readrgba(code, r, g, b, 0) || code[6] != 0 ? -1 : 0;
+}
+
+int readrgba(const char* code, int* r, int* g, int* b, int* a){
+    int value[4];
+    value[3] = 255;
+    if(readhex(code, 3, value) || (code[6] != 0 && (readhex(code + 6, 1, value + 3) || code[8] != 0)))
+        return -1;
+    if(r)
+        *r = value[0];
+    if(g)
+        *g = value[1];
+    if(b)
+        *b = value[2];
+    if(a)
+        *a = value[3];
+    return 0;
+}
+
 void cmd_ledrgb(usbmode* mode, int keyindex, const char* code){
-    unsigned int r, g, b;
-    if(sscanf(code, "%2x%2x%2x", &r, &g, &b) == 3){
-        if(r > 255)
-            r = 255;
-        if(g > 255)
-            g = 255;
-        if(b > 255)
-            b = 255;
-        int index = keymap[keyindex].led;
-        char* mr = mode->light.r;
-        char* mg = mode->light.g;
-        char* mb = mode->light.b;
-        if(index & 1){
-            mr[index / 2] = (mr[index / 2] & 0x0F) | ((7 - (r >> 5)) << 4);
-            mg[index / 2] = (mg[index / 2] & 0x0F) | ((7 - (g >> 5)) << 4);
-            mb[index / 2] = (mb[index / 2] & 0x0F) | ((7 - (b >> 5)) << 4);
-        } else {
-            mr[index / 2] = (mr[index / 2] & 0xF0) | (7 - (r >> 5));
-            mg[index / 2] = (mg[index / 2] & 0xF0) | (7 - (g >> 5));
-            mb[index / 2] = (mb[index / 2] & 0xF0) | (7 - (b >> 5));
-        }
+    int r, g, b;
+    int index = keymap[keyindex].led;
+    if(index >= 0 && !readrgb(code, &r, &g, &b)){
+        mode->light.r[index] = r;
+        mode->light.g[index] = g;
+        mode->light.b[index] = b;
+        layerdirty(mode, keyindex);
+    }
+}
+
+// Offset of each LED's color in a frame (3 * its key), or -1 if it has no key. Built from keymap the first time it's needed.
+static short ledoffset[N_KEYS];
+static int ledkeyready = 0;
+
+static void makeledkey(){
+    for(int i = 0; i < N_KEYS; i++)
+        ledoffset[i] = -1;
+    // If two keys share an LED, the later one wins (the same as setting them in order)
+    for(int i = 0; i < N_KEYS; i++){
+        int led = keymap[i].led;
+        if(led >= 0 && led < N_KEYS)
+            ledoffset[led] = i * 3;
+    }
+    ledkeyready = 1;
+}
+
+void setledframe(usbmode* mode, const unsigned char* rgb){
+    if(!ledkeyready)
+        makeledkey();
+    keylight* light = &mode->light;
+    // LEDs with no key keep whatever they had before
+    for(int i = 0; i < N_KEYS; i++){
+        int offset = ledoffset[i];
+        if(offset < 0)
+            continue;
+        light->r[i] = rgb[offset];
+        light->g[i] = rgb[offset + 1];
+        light->b[i] = rgb[offset + 2];
     }
+    layerdirtyall(mode);
 }
@@ -10,8 +10,17 @@ void initrgb(keylight* light);
 void updateleds(usbdevice* kb);
 // Saves RGB data for a device profile.
 void saveleds(usbdevice* kb, int mode);
-// Loads RGB data for a device profile.
+// Loads RGB data for a device profile. The requests are queued; each response is passed to loadledpacket().
 void loadleds(usbdevice* kb, int mode);
+// Copies one of the device's responses to loadleds() into a lighting structure. packet is 1-4.
+void loadledpacket(keylight* light, int packet, const unsigned char* data);
+
+// Packs one color channel (N_KEYS levels) into the hardware format: 7 - (c >> 5) for each LED, two LEDs per byte with the even LED in
+// the low nibble. packsse2 does the same with SSE2, and is only available if __SSE2__ is defined. N_KEYS must be a multiple of 16.
+void packscalar(const unsigned char* in, char* out);
+#ifdef __SSE2__
+void packsse2(const unsigned char* in, char* out);
+#endif
 
 // Turns LEDs off
 void cmd_ledoff(usbmode* mode);
@@ -19,5 +28,11 @@ void cmd_ledoff(usbmode* mode);
 void cmd_ledon(usbmode* mode);
 // Updates an LED color
 void cmd_ledrgb(usbmode* mode, int keyindex, const char* code);
+// Sets every key's color from N_KEYS RGB triplets (RGB_FRAME_LEN bytes) in keymap order
+void setledframe(usbmode* mode, const unsigned char* rgb);
+// Reads a color in RRGGBB hex format. Any of r, g, and b may be null. Returns 0 on success.
+int readrgb(const char* code, int* r, int* g, int* b);
+// Reads a color in RRGGBB or RRGGBBAA hex format. Alpha is 255 if it's left out. Any of r, g, b, and a may be null. Returns 0 on success.
+int readrgba(const char* code, int* r, int* g, int* b, int* a);
 
 #endif
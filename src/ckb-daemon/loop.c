@@ -0,0 +1,414 @@
+#include "loop.h"
+#include "devnode.h"
+#include "effect.h"
+#include "input.h"
+#include "led.h"
+#include "store.h"
+
+#include <poll.h>
+#ifdef OS_LINUX
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+// Time between USB packets, in nanoseconds. Messages must be queued because sending multiple messages at the same time can cause the interface
+// to freeze, so the queue is drained at a rate of 5 packets per frame.
+static long interval = 0;
+// Whether or not the pacing timer is running. It's only needed while there are packets waiting to be sent.
+static int timerarmed = 0;
+// Time of the last packet tick. When the timer starts again after at least an interval without one, the first packet is sent right away
+// instead of an interval later.
+static long long lasttick = 0;
+// Time between lighting frames, in nanoseconds. The shared framebuffers are checked once per frame while any of them are in use, and a
+// few times per second otherwise.
+static long frameinterval = 0;
+#define FRAME_IDLE_INTERVAL 250000000L
+// Time the stats nodes were last updated
+static long long statstime = 0;
+#define STATS_INTERVAL  1000000000LL
+// Time between checks for changed settings. Programs that animate through the command interface change the settings constantly, so
+// they're saved no more often than this.
+static long long storetime = 0;
+#define STORE_INTERVAL  10000000000LL
+// Number of frames since a framebuffer last changed. After a second without changes, the frame timer slows down.
+static int idleframes = 0, framesperidle = 0;
+static int frameidle = -1;
+// Set when the daemon is shutting down
+static volatile sig_atomic_t stopping = 0;
+
+long long monotime(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifdef OS_LINUX
+
+static int epfd = -1, timerfd = -1, frametimerfd = -1;
+
+// Arms a timer to fire after first nanoseconds and then every period nanoseconds, or disarms it if first is 0
+static void settimer(int fd, long long first, long long period){
+    struct itimerspec spec;
+    spec.it_value.tv_sec = first / 1000000000LL;
+    spec.it_value.tv_nsec = first % 1000000000LL;
+    spec.it_interval.tv_sec = period / 1000000000LL;
+    spec.it_interval.tv_nsec = period % 1000000000LL;
+    if(timerfd_settime(fd, 0, &spec, 0))
+        printf("Error: Failed to set timer: %s\n", strerror(errno));
+}
+
+static void sourceadd(int fd, loopsrc type, int index, short events){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // poll() and epoll use the same values for IN/OUT
+    ev.events = events;
+    ev.data.u64 = (uint64_t)type << 48 | (uint64_t)(index & 0xffff) << 32 | (uint32_t)fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+        printf("Warning: Failed to watch fd %d: %s\n", fd, strerror(errno));
+}
+
+void loopdel(int fd){
+    if(fd > 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+}
+
+#endif  // OS_LINUX
+
+#ifdef OS_MAC
+
+// OSX has no epoll, so keep a table of sources and poll() them instead
+#define SOURCE_MAX  64
+static struct {
+    int fd;
+    short events;
+    loopsrc type;
+    int index;
+} sources[SOURCE_MAX];
+static int sourcecount = 0;
+static long long nexttick = 0, nextframe = 0;
+
+static void sourceadd(int fd, loopsrc type, int index, short events){
+    if(sourcecount >= SOURCE_MAX){
+        printf("Warning: Failed to watch fd %d: Too many sources\n", fd);
+        return;
+    }
+    sources[sourcecount].fd = fd;
+    sources[sourcecount].events = events;
+    sources[sourcecount].type = type;
+    sources[sourcecount].index = index;
+    sourcecount++;
+}
+
+void loopdel(int fd){
+    for(int i = 0; i < sourcecount; i++){
+        if(sources[i].fd == fd){
+            memmove(sources + i, sources + i + 1, (sourcecount - i - 1) * sizeof(sources[0]));
+            sourcecount--;
+            return;
+        }
+    }
+}
+
+#endif  // OS_MAC
+
+void loopadd(int fd, loopsrc type, int index){
+    if(fd > 0)
+        sourceadd(fd, type, index, POLLIN);
+}
+
+static void usbfdadded(int fd, short events, void* user_data){
+    sourceadd(fd, LP_USB, 0, events);
+}
+
+static void usbfdremoved(int fd, void* user_data){
+    loopdel(fd);
+}
+
+// Sets the frame timer to run at the full frame rate, or at the idle rate
+static void setframetimer(int idle){
+    if(idle == frameidle)
+        return;
+    frameidle = idle;
+    long period = (idle ? FRAME_IDLE_INTERVAL : frameinterval);
+#ifdef OS_LINUX
+    settimer(frametimerfd, period, period);
+#else
+    nextframe = monotime() + period;
+#endif
+}
+
+// Checks the shared framebuffers for new frames, draws the lighting effects and reactive lighting, and sends dithered frames
+static void frametick(){
+    int changed = 0;
+    for(int i = 1; i < DEV_MAX; i++){
+        usbdevice* kb = keyboard + i;
+        if(kb->state >= DEV_PROFILE){
+            int drawn = readframebuffer(kb) | effecttick(kb) | reactivetick(kb);
+            // Dithered lighting changes from frame to frame even when the colors don't, so send a frame if nothing else did
+            if(kb->dither && !drawn && !kb->batching)
+                updateleds(kb);
+            changed |= drawn | kb->dither;
+        }
+    }
+    // A client that stops partway through a begin/commit block can't hold the lighting forever
+    cmdrelease(0);
+    long long now = monotime();
+    if(now - statstime >= STATS_INTERVAL){
+        statstime = now;
+        for(int i = 1; i < DEV_MAX; i++){
+            if(keyboard[i].state >= DEV_PROFILE)
+                writestats(i);
+        }
+    }
+    if(now - storetime >= STORE_INTERVAL){
+        storetime = now;
+        storeflush();
+    }
+    if(changed)
+        idleframes = 0;
+    else if(idleframes < framesperidle)
+        idleframes++;
+    setframetimer(idleframes >= framesperidle);
+}
+
+void loopwake(){
+    idleframes = 0;
+    setframetimer(0);
+}
+
+int loopinit(int fps){
+    interval = 1000000000L / fps / 5;
+    frameinterval = 1000000000L / fps;
+    framesperidle = fps;
+#ifdef OS_LINUX
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0){
+        printf("Error: Failed to create epoll instance: %s\n", strerror(errno));
+        return -1;
+    }
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timerfd < 0){
+        printf("Error: Failed to create timer: %s\n", strerror(errno));
+        return -1;
+    }
+    sourceadd(timerfd, LP_TIMER, 0, POLLIN);
+    frametimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(frametimerfd < 0){
+        printf("Error: Failed to create timer: %s\n", strerror(errno));
+        return -1;
+    }
+    sourceadd(frametimerfd, LP_FRAME, 0, POLLIN);
+#endif
+    setframetimer(1);
+    // Watch the file descriptors libusb is using, and keep track of any it adds later
+    const struct libusb_pollfd** usbfds = libusb_get_pollfds(0);
+    if(!usbfds){
+        printf("Error: Failed to get libusb file descriptors\n");
+        return -1;
+    }
+    for(const struct libusb_pollfd** fd = usbfds; *fd; fd++)
+        sourceadd((*fd)->fd, LP_USB, 0, (*fd)->events);
+    free(usbfds);
+    libusb_set_pollfd_notifiers(0, usbfdadded, usbfdremoved, 0);
+    return 0;
+}
+
+// Starts or stops the pacing timer depending on whether any device has packets waiting
+static void updatetimer(){
+    int pending = 0;
+    for(int i = 1; i < DEV_MAX; i++){
+        if(keyboard[i].state >= DEV_PROFILE && usbpending(keyboard + i) > 0){
+            pending = 1;
+            break;
+        }
+    }
+    if(pending == timerarmed)
+        return;
+    timerarmed = pending;
+    // Time until the first tick
+    long long wait = lasttick + interval - monotime();
+    if(wait < 1)
+        wait = 1;
+#ifdef OS_LINUX
+    if(pending)
+        settimer(timerfd, wait, interval);
+    else
+        settimer(timerfd, 0, 0);
+#else
+    if(pending)
+        nexttick = monotime() + wait;
+#endif
+}
+
+// Sends one packet from each device's USB queue
+static void usbtick(){
+    lasttick = monotime();
+    for(int i = 1; i < DEV_MAX; i++){
+        if(keyboard[i].state >= DEV_PROFILE)
+            usbdequeue(keyboard + i);
+    }
+}
+
+// Reads and runs any commands waiting in a device's FIFO
+static void readfifo(usbdevice* kb){
+    if(!kb->fifo)
+        return;
+    if(!linefill(&kb->fifoin, kb->fifo))
+        return;
+    char* line;
+    while((line = linenext(&kb->fifoin))){
+        if(line[0] != 0 && line[1] != 0)
+            readcmd(kb, line, SRC_FIFO(kb - keyboard));
+    }
+    // Send one lighting update for the whole batch
+    cmdflush();
+}
+
+// Handles a single ready event source. Returns 1 if libusb needs to process events.
+static int dispatch(loopsrc type, int index, int fd){
+    switch(type){
+    case LP_USB:
+        return 1;
+    case LP_TIMER:
+#ifdef OS_LINUX
+    {
+        uint64_t expirations;
+        if(read(fd, &expirations, sizeof(expirations)) > 0)
+            usbtick();
+    }
+#endif
+        break;
+    case LP_FRAME:
+#ifdef OS_LINUX
+    {
+        uint64_t expirations;
+        if(read(fd, &expirations, sizeof(expirations)) > 0)
+            frametick();
+    }
+#endif
+        break;
+    case LP_FIFO:
+        readfifo(keyboard + index);
+        break;
+    case LP_RGBFRAME:
+        readrgbframe(keyboard + index);
+        break;
+    case LP_SOCKET:
+        sockaccept(index);
+        break;
+    case LP_CLIENT:
+        sockread(index);
+        break;
+    case LP_EVENT:
+        // The event device receives an EV_LED whenever the indicators change
+        updateindicators(keyboard + index, 0);
+        break;
+    case LP_DEVICE:
+    {
+        unsigned char ready[DEV_MAX];
+        ssize_t count = read(fd, ready, sizeof(ready));
+        for(ssize_t i = 0; i < count; i++){
+            if(ready[i] < DEV_MAX)
+                openfinish(ready[i]);
+        }
+    }
+        break;
+    }
+    return 0;
+}
+
+// Gets the amount of time libusb wants to wait before handling timeouts, in milliseconds. -1 means no timeout.
+static int usbtimeout(){
+    struct timeval tv;
+    if(libusb_get_next_timeout(0, &tv) != 1)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+void loopquit(){
+    stopping = 1;
+}
+
+void looprun(){
+    while(!stopping){
+        int timeout = usbtimeout();
+        int usbevents = 0;
+#ifdef OS_LINUX
+#define EVENT_MAX   32
+        struct epoll_event events[EVENT_MAX];
+        int count = epoll_wait(epfd, events, EVENT_MAX, timeout);
+        if(count < 0 && errno != EINTR){
+            printf("Error: epoll_wait failed: %s\n", strerror(errno));
+            return;
+        }
+        // A timeout means libusb has transfers to expire
+        if(count == 0)
+            usbevents = 1;
+        for(int i = 0; i < count; i++){
+            uint64_t data = events[i].data.u64;
+            usbevents |= dispatch((loopsrc)(data >> 48), (int)(data >> 32 & 0xffff), (int)(uint32_t)data);
+        }
+#undef EVENT_MAX
+#else
+        // Wake up in time for the next USB packet and the next frame
+        long long now = monotime();
+        if(timerarmed){
+            int ticktimeout = (nexttick > now ? (nexttick - now + 999999) / 1000000 : 0);
+            if(timeout < 0 || ticktimeout < timeout)
+                timeout = ticktimeout;
+        }
+        int frametimeout = (nextframe > now ? (nextframe - now + 999999) / 1000000 : 0);
+        if(timeout < 0 || frametimeout < timeout)
+            timeout = frametimeout;
+        struct pollfd fds[SOURCE_MAX];
+        int count = sourcecount;
+        for(int i = 0; i < count; i++){
+            fds[i].fd = sources[i].fd;
+            fds[i].events = sources[i].events;
+            fds[i].revents = 0;
+        }
+        int ready = poll(fds, count, timeout);
+        if(ready < 0 && errno != EINTR){
+            printf("Error: poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if(ready == 0)
+            usbevents = 1;
+        // Look the sources up again in case a handler removed some of them
+        for(int i = 0; i < count; i++){
+            if(!fds[i].revents)
+                continue;
+            for(int j = 0; j < sourcecount; j++){
+                if(sources[j].fd == fds[i].fd){
+                    usbevents |= dispatch(sources[j].type, sources[j].index, sources[j].fd);
+                    break;
+                }
+            }
+        }
+        now = monotime();
+        if(timerarmed && now >= nexttick){
+            nexttick += interval;
+            usbtick();
+        }
+        if(now >= nextframe){
+            nextframe += (frameidle ? FRAME_IDLE_INTERVAL : frameinterval);
+            frametick();
+        }
+#endif
+        if(usbevents){
+            // Run transfer callbacks and the hotplug callback
+            struct timeval tv = { 0 };
+            libusb_handle_events_timeout_completed(0, &tv, 0);
+        }
+        // Close any devices that were unplugged. The hotplug callback may also have run while libusb events were handled elsewhere.
+        closeremoved();
+#ifdef OS_MAC
+        // OSX has no event device, so its indicators have to be checked whenever a key might have changed them
+        for(int i = 1; i < DEV_MAX; i++){
+            if(keyboard[i].state >= DEV_PROFILE)
+                updateindicators(keyboard + i, 0);
+        }
+#endif
+        updatetimer();
+    }
+}
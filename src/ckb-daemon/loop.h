@@ -0,0 +1,35 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "includes.h"
+#include "usb.h"
+
+// Event sources watched by the main loop
+typedef enum {
+    LP_USB,         // libusb file descriptor
+    LP_TIMER,       // USB output pacing timer
+    LP_FRAME,       // Lighting frame timer (shared framebuffers)
+    LP_FIFO,        // Command FIFO. Index is the keyboard number
+    LP_RGBFRAME,    // Binary lighting FIFO. Index is the keyboard number
+    LP_EVENT,       // Event device (indicator LEDs). Index is the keyboard number
+    LP_SOCKET,      // Control socket. Index is the keyboard number
+    LP_CLIENT,      // Control socket connection. Index is the connection number
+    LP_DEVICE,      // Device setup notifications. Each byte read is the number of a keyboard whose setup thread finished
+} loopsrc;
+
+// Sets up the event loop. Must be called after libusb_init. Returns 0 on success.
+int loopinit(int fps);
+// Starts watching a file descriptor for input
+void loopadd(int fd, loopsrc type, int index);
+// Stops watching a file descriptor. Must be called before closing it.
+void loopdel(int fd);
+// Runs the event loop. Returns after loopquit() is called.
+void looprun();
+// Gets the current time from the monotonic clock, in nanoseconds
+long long monotime();
+// Runs the frame timer at the full frame rate. Call this when an animation starts.
+void loopwake();
+// Stops the event loop. Safe to call from a signal handler.
+void loopquit();
+
+#endif
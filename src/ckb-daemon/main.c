@@ -2,6 +2,8 @@
 #include "devnode.h"
 #include "led.h"
 #include "input.h"
+#include "loop.h"
+#include "store.h"
 
 int usbhotplug(struct libusb_context* ctx, struct libusb_device* device, libusb_hotplug_event event, void* user_data){
     printf("Got hotplug event\n");
@@ -9,10 +11,13 @@ int usbhotplug(struct libusb_context* ctx, struct libusb_device* device, libusb_
         // Device connected: parse device
         return openusb(device);
     } else if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT){
-        // Device disconnected: look for it in the device list
+        // Device disconnected: look for it in the device list. It can't be closed from inside a libusb callback, so mark it and let the
+        // main loop close it.
         for(int i = 1; i < DEV_MAX; i++){
-            if(!usbcmp(keyboard[i].dev, device))
-                return closeusb(i);
+            if(!keyboard[i].removed && !usbcmp(keyboard[i].dev, device)){
+                __atomic_store_n(&keyboard[i].removed, 1, __ATOMIC_RELEASE);
+                return 0;
+            }
         }
     }
     return 0;
@@ -20,20 +25,23 @@ int usbhotplug(struct libusb_context* ctx, struct libusb_device* device, libusb_
 
 void quit(){
     for(int i = 1; i < DEV_MAX; i++){
+        // Wait for any devices that are still being set up, then throw them away
+        if(keyboard[i].opening){
+            closeusb(i);
+            openfinish(i);
+        }
         // Before closing, set all keyboards back to HID input mode so that the stock driver can still talk to them
-        if(keyboard[i].handle){
+        if(keyboard[i].state >= DEV_PROFILE){
             setinput(keyboard + i, IN_HID);
             // Stop the uinput device now to ensure no keys get stuck
             inputclose(i);
             // Flush the USB queue and close the device
-            while(keyboard[i].queuecount > 0){
-                usleep(3333);
-                if(usbdequeue(keyboard + i) <= 0)
-                    break;
-            }
+            usbflush(keyboard + i);
             closeusb(i);
         }
     }
+    // Save the settings one last time, now that every keyboard's settings have been moved into the store
+    storesave();
     closeusb(0);
     libusb_exit(0);
 }
@@ -47,8 +55,8 @@ void sighandler(int type){
     signal(SIGINT, sighandler2);
     signal(SIGQUIT, sighandler2);
     printf("\nCaught signal %d\n", type);
-    quit();
-    exit(0);
+    // Shut down from the main loop rather than here. libusb may be in the middle of handling events.
+    loopquit();
 }
 
 int main(int argc, char** argv){
@@ -65,9 +73,13 @@ int main(int argc, char** argv){
                 printf("Warning: Requested %d FPS but capping at 60\n", fps);
                 fps = 60;
             }
-        }
+        } else if(!strncmp(argument, "--store=", 8))
+            storepath = argument + 8;
     }
 
+    // Seed the random lighting effect
+    srand(time(0));
+
 #ifdef OS_LINUX
     // Load the uinput module (if it's not loaded already)
     if(system("modprobe uinput") != 0)
@@ -80,13 +92,20 @@ int main(int argc, char** argv){
         return -1;
     }
     libusb_set_debug(0, LIBUSB_LOG_LEVEL_NONE);
+    // Set up the event loop
+    if(loopinit(fps)){
+        printf("Fatal: Failed to initialize event loop\n");
+        return -1;
+    }
+    // Load saved settings. Keyboards found in them are restored as soon as they're plugged in, without reading the hardware.
+    storeload();
     // Make root keyboard
     umask(0);
     memset(keyboard, 0, sizeof(keyboard));
     keyboard[0].model = -1;
     if(!makedevpath(0))
         printf("Root controller ready at %s0\n", devpath);
-    // Enumerate connected devices
+    // Enumerate connected devices. Each one is set up on its own thread, so they come up in parallel.
     printf("Scanning devices\n");
     libusb_device** devices = 0;
     if(libusb_get_device_list(0, &devices) > 0){
@@ -106,39 +125,8 @@ int main(int argc, char** argv){
     signal(SIGINT, sighandler);
     signal(SIGQUIT, sighandler);
 
-    int frame = 0;
-    while(1){
-        // No need to run most of these functions on every single frame
-        if(!frame){
-            // Run hotplug callback
-            struct timeval tv = { 0 };
-            libusb_handle_events_timeout_completed(0, &tv, 0);
-            // Process FIFOs
-            for(int i = 0; i < DEV_MAX; i++){
-                if(keyboard[i].fifo){
-                    const char** lines;
-                    int nlines = readlines(keyboard[i].fifo, &lines);
-                    for(int j = 0; j < nlines; j++){
-                        if(lines[j][0] != 0 && lines[j][1] != 0)
-                            readcmd(keyboard + i, lines[j]);
-                    }
-                }
-            }
-        }
-        // Run the USB queue. Messages must be queued because sending multiple messages at the same time can cause the interface to freeze
-        for(int i = 1; i < DEV_MAX; i++){
-            if(keyboard[i].handle){
-                usbdequeue(keyboard + i);
-                // Update indicator LEDs for this keyboard. These are polled rather than processed during events because they don't update
-                // immediately and may be changed externally by the OS.
-                if(!frame)
-                    updateindicators(keyboard + i, 0);
-            }
-        }
-        // Sleep for long enough to achieve the desired frame rate (5 packets per frame).
-        usleep(1000000 / fps / 5);
-        frame = (frame + 1) % 5;
-    }
+    // Wait for commands, input, and USB events. This returns when a signal is caught (or on error)
+    looprun();
     quit();
     return 0;
 }
@@ -0,0 +1,305 @@
+#include "store.h"
+#include "devnode.h"
+#include "input.h"
+#include "layer.h"
+
+#ifndef OS_MAC
+const char* storepath = "/var/lib/ckb/settings";
+#else
+const char* storepath = "/Library/Application Support/ckb/settings";
+#endif
+
+// Whether anything has changed since the last save
+static char dirty = 0;
+
+// The file starts with a header, followed by each device's settings. Each device has its serial, its hardware profile cache, its profile
+// name and ID, and its modes. Each mode has its lighting, name, ID, and bindings, followed by its macros and lighting layers, each preceded by a count.
+// Everything is stored in native byte order, since the file never leaves the machine.
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned int keys;
+    unsigned int count;
+} storeheader;
+
+// Position in a mapped settings file
+typedef struct {
+    const char* pos;
+    const char* end;
+} storereader;
+
+// Reads size bytes from the file. Returns 0 on success or -1 if the file is too short.
+static int get(storereader* in, void* data, size_t size){
+    if((size_t)(in->end - in->pos) < size)
+        return -1;
+    memcpy(data, in->pos, size);
+    in->pos += size;
+    return 0;
+}
+
+static int loadmode(storereader* in, usbmode* mode){
+    keybind* bind = &mode->bind;
+    int macrocount, layercount;
+    if(get(in, &mode->light, sizeof(mode->light)) || get(in, mode->name, sizeof(mode->name)) || get(in, &mode->id, sizeof(mode->id))
+            || get(in, bind->base, sizeof(bind->base)) || get(in, &macrocount, sizeof(macrocount))
+            || macrocount < 0 || macrocount > MACRO_MAX)
+        return -1;
+    // Keep room for one more macro, as cmd_macro expects
+    if(macrocount >= bind->macrocap){
+        bind->macrocap = macrocount + 16;
+        bind->macros = realloc(bind->macros, bind->macrocap * sizeof(keymacro));
+    }
+    for(int i = 0; i < macrocount; i++){
+        keymacro* macro = bind->macros + i;
+        memset(macro, 0, sizeof(*macro));
+        if(get(in, macro->combo, sizeof(macro->combo)) || get(in, &macro->actioncount, sizeof(macro->actioncount))
+                || macro->actioncount < 1 || (size_t)macro->actioncount > (in->end - in->pos) / sizeof(macroaction))
+            return -1;
+        macro->actions = malloc(macro->actioncount * sizeof(macroaction));
+        bind->macrocount++;
+        get(in, macro->actions, macro->actioncount * sizeof(macroaction));
+    }
+    if(get(in, &layercount, sizeof(layercount)) || layercount < 0 || layercount > LAYER_MAX)
+        return -1;
+    if(layercount > 0)
+        getlayer(mode, layercount - 1);
+    for(int i = 0; i < layercount; i++){
+        keylayer* layer = mode->layers.layer + i;
+        if(get(in, layer->rgba, sizeof(layer->rgba)) || get(in, &layer->opacity, sizeof(layer->opacity)) || get(in, &layer->blend, sizeof(layer->blend))
+                || layer->blend < BLEND_REPLACE || layer->blend > BLEND_MULTIPLY)
+            return -1;
+    }
+    layerdirtyall(mode);
+    return 0;
+}
+
+static int loadsetting(storereader* in){
+    char serial[SERIAL_LEN];
+    int modecount, current;
+    usbprofile profile;
+    hwprofile hw;
+    memset(&profile, 0, sizeof(profile));
+    if(get(in, serial, sizeof(serial)) || get(in, &hw, sizeof(hw)) || get(in, profile.name, sizeof(profile.name)) || get(in, &profile.id, sizeof(profile.id))
+            || get(in, &modecount, sizeof(modecount)) || get(in, &current, sizeof(current))
+            || modecount < 0 || modecount > MODE_MAX || current < -1 || current >= modecount)
+        return -1;
+    serial[SERIAL_LEN - 1] = 0;
+    if(modecount > 0)
+        getusbmode(modecount - 1, &profile);
+    for(int i = 0; i < modecount; i++){
+        if(loadmode(in, profile.mode + i)){
+            eraseprofile(&profile);
+            return -1;
+        }
+    }
+    profile.currentmode = (current >= 0 ? profile.mode + current : 0);
+    usbsetting* set = addstore(serial);
+    eraseprofile(&set->profile);
+    memcpy(&set->profile, &profile, sizeof(profile));
+    memcpy(&set->hw, &hw, sizeof(hw));
+    return 0;
+}
+
+int storeload(){
+    if(!*storepath)
+        return 0;
+    int fd = open(storepath, O_RDONLY);
+    if(fd < 0){
+        // No settings saved yet
+        if(errno == ENOENT)
+            return 0;
+        printf("Warning: Failed to open %s: %s\n", storepath, strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if(fstat(fd, &info) || info.st_size < (off_t)sizeof(storeheader)){
+        printf("Warning: %s is not a settings file\n", storepath);
+        close(fd);
+        return -1;
+    }
+    const char* data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        printf("Warning: Failed to map %s: %s\n", storepath, strerror(errno));
+        return -1;
+    }
+    storereader in = { data, data + info.st_size };
+    storeheader header;
+    get(&in, &header, sizeof(header));
+    unsigned int loaded = 0;
+    if(memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) || header.version != STORE_VERSION || header.keys != N_KEYS)
+        printf("Warning: %s was written by a different version of ckb and will be replaced\n", storepath);
+    else {
+        while(loaded < header.count && !loadsetting(&in))
+            loaded++;
+        if(loaded < header.count)
+            printf("Warning: %s is damaged. Loaded %u of %u devices\n", storepath, loaded, header.count);
+        else
+            printf("Loaded settings for %u device(s) from %s\n", loaded, storepath);
+    }
+    munmap((void*)data, info.st_size);
+    return (loaded == header.count ? 0 : -1);
+}
+
+// Settings serialized for writing
+typedef struct {
+    char* data;
+    size_t length, size;
+} storebuffer;
+
+// Appends size bytes to the buffer
+static void put(storebuffer* out, const void* data, size_t size){
+    if(out->length + size > out->size){
+        out->size = (out->length + size) * 2;
+        out->data = realloc(out->data, out->size);
+    }
+    memcpy(out->data + out->length, data, size);
+    out->length += size;
+}
+
+static void savemode(storebuffer* out, const usbmode* mode){
+    const keybind* bind = &mode->bind;
+    put(out, &mode->light, sizeof(mode->light));
+    put(out, mode->name, sizeof(mode->name));
+    put(out, &mode->id, sizeof(mode->id));
+    put(out, bind->base, sizeof(bind->base));
+    put(out, &bind->macrocount, sizeof(bind->macrocount));
+    for(int i = 0; i < bind->macrocount; i++){
+        const keymacro* macro = bind->macros + i;
+        put(out, macro->combo, sizeof(macro->combo));
+        put(out, &macro->actioncount, sizeof(macro->actioncount));
+        put(out, macro->actions, macro->actioncount * sizeof(macroaction));
+    }
+    const layerstack* layers = &mode->layers;
+    put(out, &layers->count, sizeof(layers->count));
+    for(int i = 0; i < layers->count; i++){
+        const keylayer* layer = layers->layer + i;
+        put(out, layer->rgba, sizeof(layer->rgba));
+        put(out, &layer->opacity, sizeof(layer->opacity));
+        put(out, &layer->blend, sizeof(layer->blend));
+    }
+}
+
+static void savesetting(storebuffer* out, const usbsetting* set, const usbprofile* profile){
+    int current = (profile->currentmode ? profile->currentmode - profile->mode : -1);
+    put(out, set->serial, sizeof(set->serial));
+    put(out, &set->hw, sizeof(set->hw));
+    put(out, profile->name, sizeof(profile->name));
+    put(out, &profile->id, sizeof(profile->id));
+    put(out, &profile->modecount, sizeof(profile->modecount));
+    put(out, &current, sizeof(current));
+    for(int i = 0; i < profile->modecount; i++)
+        savemode(out, profile->mode + i);
+}
+
+// Writes serialized settings to the settings file. Returns 0 on success.
+static int writestore(const storebuffer* out){
+    // Make the directory if needed, then write a new file and move it over the old one. The file holds every macro (recorded keystrokes),
+    // so only root may read it.
+    char dir[strlen(storepath) + 1];
+    strcpy(dir, storepath);
+    char* slash = strrchr(dir, '/');
+    if(slash && slash != dir){
+        *slash = 0;
+        mkdir(dir, S_IRWXU);
+    }
+    char newpath[strlen(storepath) + 5];
+    snprintf(newpath, sizeof(newpath), "%s.new", storepath);
+    int fd = open(newpath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd < 0){
+        printf("Error: Failed to write %s: %s\n", newpath, strerror(errno));
+        return -1;
+    }
+    // A file left over from before might have been created with other permissions
+    fchmod(fd, S_IRUSR | S_IWUSR);
+    size_t written = 0;
+    while(written < out->length){
+        ssize_t res = write(fd, out->data + written, out->length - written);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            break;
+        written += res;
+    }
+    // Make sure the data is on disk before the rename, or a crash could leave an empty file in place of the old one
+    if(written < out->length || fsync(fd)){
+        printf("Error: Failed to write %s: %s\n", newpath, strerror(errno));
+        close(fd);
+        remove(newpath);
+        return -1;
+    }
+    close(fd);
+    if(rename(newpath, storepath)){
+        printf("Error: Failed to replace %s: %s\n", storepath, strerror(errno));
+        remove(newpath);
+        return -1;
+    }
+    return 0;
+}
+
+// Set while the save thread is writing the file. Only one save runs at a time.
+static int saving = 0;
+
+static void* savethread(void* context){
+    storebuffer* out = context;
+    writestore(out);
+    free(out->data);
+    free(out);
+    __atomic_store_n(&saving, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Serializes the settings of every device in the store
+static void serialize(storebuffer* out){
+    storeheader header = { { 0 }, STORE_VERSION, N_KEYS, storecount };
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    put(out, &header, sizeof(header));
+    // Connected devices hold their own settings. The stored copy is only brought up to date when they're unplugged.
+    for(usbsetting* set = storenext(0); set; set = storenext(set)){
+        usbdevice* kb = findusb(set->serial);
+        savesetting(out, set, kb ? &kb->setting.profile : &set->profile);
+    }
+}
+
+int storesave(){
+    if(!*storepath)
+        return 0;
+    // Let a save in progress finish first, so that it can't replace this one
+    while(__atomic_load_n(&saving, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    storebuffer out = { 0 };
+    serialize(&out);
+    int res = writestore(&out);
+    free(out.data);
+    if(!res)
+        dirty = 0;
+    return res;
+}
+
+void storechanged(){
+    dirty = 1;
+}
+
+void storeflush(){
+    // Writing and syncing the file can take a while, so it's done on another thread to keep it out of the way of key input. If a save is
+    // still running, this one waits for the next call.
+    if(!dirty || !*storepath || __atomic_load_n(&saving, __ATOMIC_ACQUIRE))
+        return;
+    // Don't try again until something else changes, or a failing disk would get an error every time
+    dirty = 0;
+    storebuffer* out = calloc(1, sizeof(storebuffer));
+    serialize(out);
+    __atomic_store_n(&saving, 1, __ATOMIC_RELEASE);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&thread, &attr, savethread, out)){
+        // Save now instead
+        writestore(out);
+        free(out->data);
+        free(out);
+        __atomic_store_n(&saving, 0, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,27 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "includes.h"
+#include "usb.h"
+
+// Settings file. Holds every profile the daemon knows about, whether or not its keyboard is plugged in, so settings survive a restart.
+// Set to an empty string (--store=) to keep settings in memory only.
+extern const char* storepath;
+
+// Settings file format. The version must be increased whenever the layout (or any structure written as-is) changes; files with a
+// different version are ignored.
+#define STORE_MAGIC     "CKBS"
+#define STORE_VERSION   2
+
+// Loads the settings file into the device store. Must be called before any devices are opened. Returns 0 on success, including when the
+// file doesn't exist yet.
+int storeload();
+// Writes the settings of every stored and connected device to the settings file, after waiting for any save already in progress. The
+// file is replaced atomically. Returns 0 on success.
+int storesave();
+// Marks the settings as changed since the last save
+void storechanged();
+// Saves the settings if they changed. The settings are copied right away, but the file is written on another thread.
+void storeflush();
+
+#endif
@@ -1,42 +1,106 @@
 #include "usb.h"
 #include "devnode.h"
+#include "layer.h"
 #include "led.h"
 #include "input.h"
+#include "loop.h"
+#include "store.h"
 
 usbdevice keyboard[DEV_MAX];
-usbsetting* store = 0;
+
+// Device store. Settings are hashed by serial number, and each one is allocated separately so that pointers to it stay valid as the store
+// grows. Each entry also points to its device while it's plugged in.
+typedef struct storenode {
+    usbsetting setting;
+    usbdevice* kb;
+    struct storenode* next;
+} storenode;
+static storenode** storetable = 0;
+static int storebuckets = 0;        // Always a power of two
 int storecount = 0;
+#define STORE_MIN_BUCKETS   16
 
-usbdevice* findusb(const char* serial){
-    for(int i = 0; i < DEV_MAX; i++){
-        if(keyboard[i].fifo && !strcmp(serial, keyboard[i].setting.serial))
-            return keyboard + i;
+// FNV-1a hash of a serial number
+static unsigned hashserial(const char* serial){
+    unsigned hash = 2166136261u;
+    for(; *serial; serial++)
+        hash = (hash ^ (unsigned char)*serial) * 16777619u;
+    return hash;
+}
+
+static storenode* findnode(const char* serial){
+    if(!storecount)
+        return 0;
+    for(storenode* node = storetable[hashserial(serial) & (storebuckets - 1)]; node; node = node->next){
+        if(!strcmp(node->setting.serial, serial))
+            return node;
     }
     return 0;
 }
 
+usbdevice* findusb(const char* serial){
+    storenode* node = findnode(serial);
+    return (node ? node->kb : 0);
+}
+
 usbsetting* findstore(const char* serial){
-    for(int i = 0; i < storecount; i++){
-        usbsetting* res = store + i;
-        if(!strcmp(res->serial, serial))
-            return res;
-    }
-    return 0;
+    storenode* node = findnode(serial);
+    return (node ? &node->setting : 0);
 }
 
-usbsetting* addstore(const char* serial){
+static storenode* addnode(const char* serial){
     // Try to find the device before adding it
-    usbsetting* res = findstore(serial);
-    if(res)
-        return res;
-    // Add device to the list
-    store = realloc(store, ++storecount * sizeof(usbsetting));
-    res = store + storecount - 1;
+    storenode* node = findnode(serial);
+    if(node)
+        return node;
+    // Double the table when it's full. Only the bucket array moves; the entries stay where they are.
+    if(storecount >= storebuckets){
+        int buckets = (storebuckets ? storebuckets * 2 : STORE_MIN_BUCKETS);
+        storenode** table = calloc(buckets, sizeof(storenode*));
+        for(int i = 0; i < storebuckets; i++){
+            storenode* node = storetable[i];
+            while(node){
+                storenode* next = node->next;
+                storenode** bucket = table + (hashserial(node->setting.serial) & (buckets - 1));
+                node->next = *bucket;
+                *bucket = node;
+                node = next;
+            }
+        }
+        free(storetable);
+        storetable = table;
+        storebuckets = buckets;
+    }
+    // Add device to the table
+    node = calloc(1, sizeof(storenode));
+    storenode** bucket = storetable + (hashserial(serial) & (storebuckets - 1));
+    node->next = *bucket;
+    *bucket = node;
+    storecount++;
     // Initialize device
-    memset(&res->profile, 0, sizeof(res->profile));
-    strcpy(res->serial, serial);
-    genid(&res->profile.id);
-    return res;
+    strncpy(node->setting.serial, serial, SERIAL_LEN - 1);
+    genid(&node->setting.profile.id);
+    return node;
+}
+
+usbsetting* addstore(const char* serial){
+    return &addnode(serial)->setting;
+}
+
+usbsetting* storenext(usbsetting* prev){
+    // Settings are the first member of their entry, so the entry can be found from them
+    int bucket = 0;
+    if(prev){
+        storenode* node = (storenode*)prev;
+        if(node->next)
+            return &node->next->setting;
+        bucket = (hashserial(prev->serial) & (storebuckets - 1)) + 1;
+    }
+    for(; bucket < storebuckets; bucket++){
+        if(storetable[bucket])
+            return &storetable[bucket]->setting;
+    }
+    return 0;
 }
 
 usbmode* getusbmode(int id, usbprofile* profile){
@@ -51,6 +115,7 @@ usbmode* getusbmode(int id, usbprofile* profile){
     for(int i = profile->modecount; i <= id; i++){
         initrgb(&profile->mode[i].light);
         initbind(&profile->mode[i].bind);
+        memset(&profile->mode[i].layers, 0, sizeof(profile->mode[i].layers));
         memset(profile->mode[i].name, 0, sizeof(profile->mode[i].name));
         genid(&profile->mode[i].id);
     }
@@ -111,6 +176,7 @@ void setprofilename(usbprofile* profile, const char* name){
 
 void erasemode(usbmode *mode){
     closebind(&mode->bind);
+    closelayers(&mode->layers);
     memset(mode, 0, sizeof(*mode));
     initrgb(&mode->light);
     initbind(&mode->bind);
@@ -119,8 +185,10 @@ void erasemode(usbmode *mode){
 
 void eraseprofile(usbprofile* profile){
     // Clear all mode data
-    for(int i = 0; i < profile->modecount; i++)
+    for(int i = 0; i < profile->modecount; i++){
         closebind(&profile->mode[i].bind);
+        closelayers(&profile->mode[i].layers);
+    }
     free(profile->mode);
     memset(profile, 0, sizeof(*profile));
     genid(&profile->id);
@@ -148,63 +216,154 @@ void updatemod(usbid* id){
     memcpy(id->modified, &new, 2);
 }
 
-void hwloadmode(usbdevice* kb, int mode){
-    // Ask for mode's name
-    usbmode* kbmode = kb->setting.profile.mode + mode;
-    unsigned char data_pkt[MSG_SIZE] = { 0x0e, 0x16, 0x01, mode + 1, 0 };
-    usbqueue(kb, data_pkt, 1);
-    usleep(3333);
-    usbdequeue(kb);
-    // Wait for the response
-    libusb_control_transfer(kb->handle, 0xa1, 1, 0x0300, 0x03, data_pkt, MSG_SIZE, 500);
-    if(data_pkt[0] == 0x0e && data_pkt[1] == 0x01)
-        memcpy(kbmode->name, data_pkt + 4, MD_NAME_LEN * 2);
-    // Load the RGB setting
-    loadleds(kb, mode);
+// Loading the hardware profile is done in two stages. First the profile and mode IDs are requested, then the names and lighting. Requests
+// are queued all at once and sent back-to-back; the responses come back through hwresponse(), and when the last one arrives the next stage
+// begins. The hardware updates the IDs whenever the profile is saved, so if they match the cached copy, the second stage is skipped.
+// Responses go into kb->hwstage rather than the profile, so that nothing is changed until the whole load is done. Commands that arrive
+// in the meantime are held and run afterward (see cmdhold/cmdreplay), since the load would otherwise overwrite their changes.
+
+// Gets a device's hardware profile cache from its store entry
+static hwprofile* gethwcache(usbdevice* kb){
+    usbsetting* store = findstore(kb->setting.serial);
+    return (store ? &store->hw : 0);
+}
+
+static void hwloaddata(usbdevice* kb){
+    kb->hwload = HW_DATA;
+    // Ask for profile name
+    unsigned char data_pkt[MSG_SIZE] = { 0x0e, 0x16, 0x01, 0 };
+    usbqueuereq(kb, data_pkt, HWT_PROFILENAME);
+    kb->hwpending = 1;
+    int modes = (kb->model == 95 ? 3 : 1);
+    for(int i = 0; i < modes; i++){
+        // Ask for mode's name
+        data_pkt[3] = i + 1;
+        usbqueuereq(kb, data_pkt, HWT_MODENAME | i << 4);
+        // Load the RGB setting
+        loadleds(kb, i);
+        kb->hwpending += 5;
+    }
+}
+
+// Marks a device as ready to use
+static void devlive(usbdevice* kb){
+    kb->state = DEV_LIVE;
+    updateconnected();
+    printf("Device ready at %s%d\n", devpath, (int)(kb - keyboard));
+}
+
+static void hwloaddone(usbdevice* kb){
+    kb->hwload = HW_IDLE;
+    // Update the profile from what was loaded, and remember it unless part of it couldn't be read
+    hwprofile* stage = &kb->hwstage;
+    hwprofile* cache = gethwcache(kb);
+    usbprofile* profile = &kb->setting.profile;
+    int modes = (kb->model == 95 ? 3 : 1);
+    if(profile->modecount >= modes){
+        memcpy(&profile->id, &stage->id, sizeof(usbid));
+        memcpy(profile->name, stage->name, sizeof(profile->name));
+        for(int i = 0; i < modes; i++){
+            memcpy(&profile->mode[i].id, stage->modeid + i, sizeof(usbid));
+            memcpy(profile->mode[i].name, stage->modename[i], sizeof(profile->mode[i].name));
+            memcpy(&profile->mode[i].light, stage->light + i, sizeof(keylight));
+            layerdirtyall(profile->mode + i);
+        }
+        if(cache){
+            memcpy(cache, stage, sizeof(*cache));
+            cache->valid = kb->hwok;
+        }
+    }
+    printf("Loaded hardware profile for %s (S/N: %s)\n", kb->name, kb->setting.serial);
+    storechanged();
+    // Now that the load can't overwrite them, run the commands that came in while it was going
+    cmdreplay(kb);
+    kb->ledsdirty = 1;
+    cmdflush();
+    if(kb->state == DEV_PROFILE)
+        devlive(kb);
+}
+
+// Fills in the names and lighting from the cache, once the IDs are known to match
+static void hwloadcached(usbdevice* kb){
+    hwprofile* cache = gethwcache(kb);
+    hwprofile* stage = &kb->hwstage;
+    memcpy(stage->name, cache->name, sizeof(stage->name));
+    memcpy(stage->modename, cache->modename, sizeof(stage->modename));
+    memcpy(stage->light, cache->light, sizeof(stage->light));
+    hwloaddone(kb);
+}
+
+void hwresponse(usbdevice* kb, int tag, const unsigned char* data){
+    hwprofile* stage = &kb->hwstage;
+    int mode = (tag >> 4) & 0xf;
+    // If the request failed, there's nothing to copy
+    if(data && mode < HW_MODES){
+        hwprofile* cache = gethwcache(kb);
+        switch(tag & HWT_KIND){
+        case HWT_PROFILEID:
+            memcpy(&stage->id, data + 4, sizeof(usbid));
+            if(!cache || memcmp(&cache->id, data + 4, sizeof(usbid)))
+                kb->hwok = 0;
+            break;
+        case HWT_MODEID:
+            memcpy(stage->modeid + mode, data + 4, sizeof(usbid));
+            if(!cache || memcmp(cache->modeid + mode, data + 4, sizeof(usbid)))
+                kb->hwok = 0;
+            break;
+        case HWT_PROFILENAME:
+            memcpy(stage->name, data + 4, PR_NAME_LEN * 2);
+            break;
+        case HWT_MODENAME:
+            if(data[0] == 0x0e && data[1] == 0x01)
+                memcpy(stage->modename[mode], data + 4, MD_NAME_LEN * 2);
+            break;
+        case HWT_LEDS:
+            loadledpacket(stage->light + mode, tag & 0xf, data);
+            break;
+        }
+    } else
+        kb->hwok = 0;
+    if(--kb->hwpending > 0)
+        return;
+    // Move on to the next stage, unless the rest of the profile is already known
+    if(kb->hwload == HW_IDS){
+        if(kb->hwok)
+            hwloadcached(kb);
+        else {
+            kb->hwok = 1;
+            hwloaddata(kb);
+        }
+    } else
+        hwloaddone(kb);
 }
 
 void hwloadprofile(usbdevice* kb){
-    if(!kb || !kb->handle)
+    if(!kb || !kb->handle || kb->hwload != HW_IDLE)
         return;
-    // Empty the board's USB queue
-    while(kb->queuecount > 0){
-        usleep(3333);
-        usbdequeue(kb);
+    kb->hwload = HW_IDS;
+    hwprofile* cache = gethwcache(kb);
+    kb->hwok = (cache && cache->valid);
+    // Make sure the modes exist, and start from the current profile so that anything that can't be read stays the same
+    usbprofile* profile = &kb->setting.profile;
+    hwprofile* stage = &kb->hwstage;
+    int modes = (kb->model == 95 ? 3 : 1);
+    memcpy(&stage->id, &profile->id, sizeof(usbid));
+    memcpy(stage->name, profile->name, sizeof(stage->name));
+    for(int i = 0; i < modes; i++){
+        usbmode* mode = getusbmode(i, profile);
+        memcpy(stage->modeid + i, &mode->id, sizeof(usbid));
+        memcpy(stage->modename[i], mode->name, sizeof(stage->modename[i]));
+        memcpy(stage->light + i, &mode->light, sizeof(keylight));
     }
     // Ask for profile ID
-    usbprofile* profile = &kb->setting.profile;
-    unsigned char data_pkt[2][MSG_SIZE] = {
-        { 0x0e, 0x15, 0x01, 0 },
-        { 0x0e, 0x16, 0x01, 0 }
-    };
-    unsigned char in_pkt[MSG_SIZE];
-    usbqueue(kb, data_pkt[0], 1);
-    usleep(3333);
-    usbdequeue(kb);
-    // Wait for the response
-    libusb_control_transfer(kb->handle, 0xa1, 1, 0x0300, 0x03, in_pkt, MSG_SIZE, 500);
-    memcpy(&profile->id, in_pkt + 4, sizeof(usbid));
+    unsigned char data_pkt[MSG_SIZE] = { 0x0e, 0x15, 0x01, 0 };
+    usbqueuereq(kb, data_pkt, HWT_PROFILEID);
     // Ask for mode IDs
-    int modes = (kb->model == 95 ? 3 : 1);
     for(int i = 0; i < modes; i++){
-        data_pkt[0][3] = i + 1;
-        usbqueue(kb, data_pkt[0], 1);
-        usleep(3333);
-        usbdequeue(kb);
-        // Wait for the response
-        libusb_control_transfer(kb->handle, 0xa1, 1, 0x0300, 0x03, in_pkt, MSG_SIZE, 500);
-        memcpy(&profile->mode[i].id, in_pkt + 4, sizeof(usbid));
+        data_pkt[3] = i + 1;
+        usbqueuereq(kb, data_pkt, HWT_MODEID | i << 4);
     }
-    // Ask for profile name
-    usbqueue(kb, data_pkt[1], 1);
-    usleep(3333);
-    usbdequeue(kb);
-    // Wait for the response
-    libusb_control_transfer(kb->handle, 0xa1, 1, 0x0300, 0x03, in_pkt, MSG_SIZE, 500);
-    memcpy(kb->setting.profile.name, in_pkt + 4, PR_NAME_LEN * 2);
-    // Load modes
-    for(int i = 0; i < modes; i++)
-        hwloadmode(kb, i);
+    kb->hwpending = modes + 1;
 }
 
 void hwsaveprofile(usbdevice* kb){
@@ -237,71 +396,362 @@ void hwsaveprofile(usbdevice* kb){
     // Save the RGB data
     for(int i = 0; i < modes; i++)
         saveleds(kb, i);
+    // The hardware now has the current profile's IDs, but the lighting it stores isn't quite the same as ours (it only keeps the levels the
+    // keyboard can show), so the profile has to be read again next time
+    hwprofile* cache = gethwcache(kb);
+    if(cache)
+        cache->valid = 0;
 }
 
-int usbqueue(usbdevice* kb, unsigned char* messages, int count){
-    // Don't add messages unless the queue has enough room for all of them
-    if(kb->queuecount + count > QUEUE_LEN)
+// The USB queue is a single-producer, single-consumer ring buffer. Packets are added by usbqueue()/usbqueueframe() and removed by the transfer
+// callback, so the head is only written by the producer and the tail is only written by the consumer. One slot is always kept free for a
+// frame marker so that a lighting frame can never be locked out by control packets.
+
+static int queuefree(usbdevice* kb){
+    unsigned int tail = __atomic_load_n(&kb->queuetail, __ATOMIC_ACQUIRE);
+    return QUEUE_LEN - (int)(kb->queuehead - tail);
+}
+
+static void queuepush(usbdevice* kb, const unsigned char* data, int length, char type){
+    usbpacket* packet = kb->queue + kb->queuehead % QUEUE_LEN;
+    packet->type = type;
+    if(length)
+        memcpy(packet->data, data, length);
+    __atomic_store_n(&kb->queuehead, kb->queuehead + 1, __ATOMIC_RELEASE);
+    unsigned int depth = QUEUE_LEN - queuefree(kb);
+    if(depth > kb->stats.queuemax)
+        kb->stats.queuemax = depth;
+}
+
+static int queuecontrol(usbdevice* kb, const unsigned char* messages, int count, int length, char type){
+    if(!kb->queue)
         return -1;
+    // Control packets must not be dropped, so the queue is sized such that this should never happen. If it does, say so.
+    if(queuefree(kb) - 1 < count){
+        kb->stats.dropped += count;
+        printf("Warning: USB queue full for %s (S/N: %s), dropping %d packet(s)\n", kb->name, kb->setting.serial, count);
+        return -1;
+    }
     for(int i = 0; i < count; i++)
-        memcpy(kb->queue[kb->queuecount + i], messages + MSG_SIZE * i, MSG_SIZE);
-    kb->queuecount += count;
+        queuepush(kb, messages + length * i, length, type);
+    return 0;
+}
+
+int usbqueue(usbdevice* kb, unsigned char* messages, int count){
+    return queuecontrol(kb, messages, count, MSG_SIZE, PK_CTRL);
+}
+
+int usbqueuereq(usbdevice* kb, unsigned char* message, int tag){
+    if(queuecontrol(kb, message, 1, MSG_SIZE, PK_REQ))
+        return -1;
+    kb->queue[(kb->queuehead - 1) % QUEUE_LEN].tag = tag;
     return 0;
 }
 
+int usbqueueind(usbdevice* kb, unsigned char ileds){
+    return queuecontrol(kb, &ileds, 1, 1, PK_IND);
+}
+
+void usbqueueframe(usbdevice* kb, unsigned char frame[FRAME_LEN][MSG_SIZE]){
+    if(!kb->queue)
+        return;
+    // Skip frames that don't change anything
+    if(__atomic_load_n(&kb->lastvalid, __ATOMIC_RELAXED) && !memcmp(kb->lastframe, frame, sizeof(kb->lastframe)))
+        return;
+    memcpy(kb->lastframe, frame, sizeof(kb->lastframe));
+    kb->lastvalid = 1;
+    // Write the frame into the producer's buffer, then swap it with the pending one
+    memcpy(kb->frames[kb->framewrite], frame, sizeof(kb->frames[0]));
+    int old = __atomic_exchange_n(&kb->framenext, kb->framewrite | FRAME_FRESH, __ATOMIC_ACQ_REL);
+    kb->framewrite = old & FRAME_INDEX;
+    // If there was already a frame waiting, this one replaces it and takes its place in the queue. Otherwise, add a marker for it.
+    if(!(old & FRAME_FRESH))
+        queuepush(kb, 0, 0, PK_FRAME);
+    else
+        kb->stats.replaced++;
+}
+
+int usbframewaiting(usbdevice* kb){
+    return (__atomic_load_n(&kb->framenext, __ATOMIC_ACQUIRE) & FRAME_FRESH) != 0;
+}
+
+int usbpending(usbdevice* kb){
+    if(!kb->queue)
+        return 0;
+    return (int)(kb->queuehead - __atomic_load_n(&kb->queuetail, __ATOMIC_ACQUIRE)) + (kb->framepos >= 0);
+}
+
+// Gets the first packet in the USB queue, or null if there isn't one
+static usbpacket* queuepeek(usbdevice* kb){
+    if(__atomic_load_n(&kb->queuehead, __ATOMIC_ACQUIRE) == kb->queuetail)
+        return 0;
+    return kb->queue + kb->queuetail % QUEUE_LEN;
+}
+
+// Removes the first packet from the USB queue
+static void queuepop(usbdevice* kb){
+    __atomic_store_n(&kb->queuetail, kb->queuetail + 1, __ATOMIC_RELEASE);
+}
+
+// Moves past the packet that was just sent
+static void queueadvance(usbdevice* kb){
+    if(kb->framepos >= 0){
+        if(++kb->framepos == FRAME_LEN)
+            kb->framepos = -1;
+    } else
+        queuepop(kb);
+}
+
+static void ctrlcallback(struct libusb_transfer* transfer);
+
+// Records the result of a control transfer in the device's stats
+static void countctrl(usbdevice* kb, enum libusb_transfer_status status){
+    usbstats* stats = &kb->stats;
+    switch(status){
+    case LIBUSB_TRANSFER_CANCELLED:
+        return;
+    case LIBUSB_TRANSFER_COMPLETED:
+        stats->sent++;
+        // The commit packet is the last one in a frame
+        if(kb->framepos == FRAME_LEN - 1)
+            stats->frames++;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        stats->timeouts++;
+        break;
+    default:
+        stats->errors++;
+        break;
+    }
+    long long latency = (monotime() - stats->ctrlstart) / 1000000;
+    int bucket = 0;
+    while(bucket < LATENCY_BUCKETS - 1 && latency >= 1 << bucket)
+        bucket++;
+    stats->latency[bucket]++;
+}
+
+// Asks for the response to a hardware request, using the same transfer. Returns 0 on success.
+static int ctrlread(usbdevice* kb){
+    unsigned char* buffer = kb->ctrl->buffer;
+    libusb_fill_control_setup(buffer, 0xa1, 0x01, 0x0300, 0x03, MSG_SIZE);
+    libusb_fill_control_transfer(kb->ctrl, kb->handle, buffer, ctrlcallback, kb, 500);
+    if(libusb_submit_transfer(kb->ctrl))
+        return -1;
+    kb->ctrlbusy = kb->ctrlread = 1;
+    kb->stats.ctrlstart = monotime();
+    return 0;
+}
+
+static void ctrlcallback(struct libusb_transfer* transfer){
+    usbdevice* kb = transfer->user_data;
+    kb->ctrlbusy = 0;
+    int read = kb->ctrlread;
+    kb->ctrlread = 0;
+    // If the device is being closed, closehandle() frees the transfer once it's back
+    if(kb->closing)
+        return;
+    countctrl(kb, transfer->status);
+    switch(transfer->status){
+    case LIBUSB_TRANSFER_CANCELLED:
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        // The device is gone, so nothing else will get through
+        kb->framepos = -1;
+        kb->hwload = HW_IDLE;
+        __atomic_store_n(&kb->queuetail, __atomic_load_n(&kb->queuehead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        break;
+    default:;
+        int ok = (transfer->status == LIBUSB_TRANSFER_COMPLETED);
+        // If part of a frame was lost, the device isn't showing it, so don't treat the next identical frame as a duplicate
+        if(!ok && kb->framepos >= 0)
+            __atomic_store_n(&kb->lastvalid, 0, __ATOMIC_RELAXED);
+        usbpacket* packet = (kb->framepos < 0 ? queuepeek(kb) : 0);
+        if(packet && packet->type == PK_REQ && packet->tag){
+            // Hardware requests need their response read back before moving on
+            if(!read && ok && !ctrlread(kb))
+                return;
+            hwresponse(kb, packet->tag, (read && ok) ? libusb_control_transfer_get_data(transfer) : 0);
+        }
+        // Advance the queue. Messages that fail are dropped rather than retried, the same as they always have been
+        queueadvance(kb);
+        // Hardware requests are sent back-to-back instead of waiting for the next packet interval
+        if(kb->framepos < 0 && (packet = queuepeek(kb)) && packet->type == PK_REQ)
+            usbdequeue(kb);
+        break;
+    }
+}
+
 int usbdequeue(usbdevice* kb){
-    if(kb->queuecount == 0 || !kb->handle)
+    if(!kb->handle || !kb->ctrl || kb->ctrlbusy)
+        return 0;
+    // Find the next packet. A frame that has been started is always finished before anything else is sent.
+    const unsigned char* data = 0;
+    char type = PK_CTRL;
+    if(kb->framepos < 0){
+        if(__atomic_load_n(&kb->queuehead, __ATOMIC_ACQUIRE) == kb->queuetail)
+            return 0;
+        usbpacket* packet = kb->queue + kb->queuetail % QUEUE_LEN;
+        type = packet->type;
+        if(type == PK_FRAME){
+            // Take the newest frame and remove the marker. Every packet of it is sent, since the commit packet applies the whole LED buffer.
+            int old = __atomic_exchange_n(&kb->framenext, kb->framesend, __ATOMIC_ACQ_REL);
+            kb->framesend = old & FRAME_INDEX;
+            kb->framepos = 0;
+            queuepop(kb);
+        } else
+            data = packet->data;
+    }
+    if(kb->framepos >= 0)
+        data = kb->frames[kb->framesend][kb->framepos];
+    // Submit it. It stays in the queue until the transfer completes
+    unsigned char* buffer = kb->ctrl->buffer;
+    if(type == PK_IND){
+        // Indicator LEDs go to the HID interface instead of the LED controller
+        libusb_fill_control_setup(buffer, 0x21, 0x09, 0x0200, 0x00, 1);
+        buffer[LIBUSB_CONTROL_SETUP_SIZE] = data[0];
+    } else {
+        libusb_fill_control_setup(buffer, 0x21, 0x09, 0x0300, 0x03, MSG_SIZE);
+        memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, MSG_SIZE);
+    }
+    libusb_fill_control_transfer(kb->ctrl, kb->handle, buffer, ctrlcallback, kb, 500);
+    if(libusb_submit_transfer(kb->ctrl)){
+        // Couldn't submit it, so drop it. A hardware request still needs its (failed) response, or a hardware load would never finish.
+        kb->stats.errors++;
+        if(kb->framepos >= 0)
+            __atomic_store_n(&kb->lastvalid, 0, __ATOMIC_RELAXED);
+        usbpacket* packet = (kb->framepos < 0 ? queuepeek(kb) : 0);
+        if(packet && packet->type == PK_REQ && packet->tag)
+            hwresponse(kb, packet->tag, 0);
+        queueadvance(kb);
         return 0;
-    int count = libusb_control_transfer(kb->handle, 0x21, 0x09, 0x0300, 0x03, kb->queue[0], MSG_SIZE, 500);
-    // Rotate queue
-    unsigned char* first = kb->queue[0];
-    for(int i = 1; i < QUEUE_LEN; i++)
-        kb->queue[i - 1] = kb->queue[i];
-    kb->queue[QUEUE_LEN - 1] = first;
-    kb->queuecount--;
-    return count;
+    }
+    kb->ctrlbusy = 1;
+    kb->stats.ctrlstart = monotime();
+    return (type == PK_IND ? 1 : MSG_SIZE);
+}
+
+void usbflush(usbdevice* kb){
+    while(kb->handle && kb->ctrl && (usbpending(kb) > 0 || kb->ctrlbusy)){
+        if(!kb->ctrlbusy){
+            usleep(3333);
+            usbdequeue(kb);
+        }
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(0, &tv, 0);
+    }
+}
+
+// Gets a histogram bucket. Values under HIST_SUB get one bucket each; above that, the top 4 bits pick the bucket.
+static int histbucket(long long ns){
+    if(ns < HIST_SUB)
+        return (ns < 0 ? 0 : ns);
+    int exponent = 63 - __builtin_clzll(ns);
+    int bucket = (exponent - 2) * HIST_SUB + (int)(ns >> (exponent - 3) & (HIST_SUB - 1));
+    return (bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1);
+}
+
+// Gets the largest value in a histogram bucket
+static long long histlimit(int bucket){
+    if(bucket < HIST_SUB)
+        return bucket;
+    int exponent = bucket / HIST_SUB + 2;
+    return ((long long)(HIST_SUB + bucket % HIST_SUB + 1) << (exponent - 3)) - 1;
+}
+
+void histadd(latencyhist* hist, long long ns){
+    __atomic_add_fetch(hist->bucket + histbucket(ns), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&hist->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+long long histpercentile(const latencyhist* hist, float fraction){
+    unsigned long long count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if(count == 0)
+        return 0;
+    unsigned long long target = count * fraction, seen = 0;
+    long long max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += __atomic_load_n(hist->bucket + i, __ATOMIC_RELAXED);
+        if(seen > target){
+            long long limit = histlimit(i);
+            return (limit < max ? limit : max);
+        }
+    }
+    return max;
+}
+
+void histreset(latencyhist* hist){
+    for(int i = 0; i < HIST_BUCKETS; i++)
+        __atomic_store_n(hist->bucket + i, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+}
+
+// Frees a key input transfer and clears its slot, so that closehandle() knows it's gone
+static void intfree(usbdevice* kb, struct libusb_transfer* transfer){
+    for(int i = 0; i < INT_COUNT; i++){
+        if(kb->keyint[i] == transfer){
+            kb->keyint[i] = 0;
+            // Transfers cancelled by closehandle() aren't errors
+            if(transfer->status != LIBUSB_TRANSFER_CANCELLED && !kb->closing)
+                kb->stats.inputerrors++;
+        }
+    }
+    libusb_free_transfer(transfer);
 }
 
 void icorcallback(struct libusb_transfer* transfer){
+    long long start = monotime();
     usbdevice* kb = transfer->user_data;
-    // If the transfer didn't finish successfully, free it
-    if(transfer->status != LIBUSB_TRANSFER_COMPLETED){
-        libusb_free_transfer(transfer);
-        if(kb->keyint == transfer)
-            kb->keyint = 0;
+    // If the transfer didn't finish successfully, or the device is being closed, free it
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED || kb->closing){
+        intfree(kb, transfer);
         return;
     }
-
-    // Process key data
     if(transfer->actual_length < MSG_SIZE){
-        libusb_submit_transfer(transfer);
+        if(libusb_submit_transfer(transfer))
+            intfree(kb, transfer);
         return;
     }
-    inputupdate(kb);
-
-    // Re-submit the transfer
-    libusb_submit_transfer(transfer);
+    // Take the key data and re-submit the transfer right away, so that the next report has somewhere to go while this one is processed.
+    // Transfers on the same endpoint complete in order, so the reports are still handled in order.
+    memcpy(kb->intinput, transfer->buffer, MSG_SIZE);
+    if(libusb_submit_transfer(transfer))
+        intfree(kb, transfer);
+    kb->stats.inputs++;
+    inputupdate(kb, start);
 }
 
 void ihidcallback(struct libusb_transfer* transfer){
-    // If the transfer didn't finish successfully, free it
-    if(transfer->status != LIBUSB_TRANSFER_COMPLETED){
-        free(transfer->buffer);
+    usbdevice* kb = transfer->user_data;
+    // All useful inputs come from the corsair interface, so don't bother processing this
+    // Re-submit the transfer. If it didn't finish successfully, or the device is being closed, free it instead
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED || kb->closing || libusb_submit_transfer(transfer)){
+        kb->hidint = 0;
         libusb_free_transfer(transfer);
-        return;
     }
-    // All useful inputs come from the corsair interface, so don't bother processing this
-    // Re-submit the transfer
-    libusb_submit_transfer(transfer);
 }
 
 void setint(usbdevice* kb){
-    kb->keyint = libusb_alloc_transfer(0);
-    libusb_fill_interrupt_transfer(kb->keyint, kb->handle, 0x83, kb->intinput, MSG_SIZE, icorcallback, kb, 0);
-    libusb_submit_transfer(kb->keyint);
+    for(int i = 0; i < INT_COUNT; i++){
+        struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+        libusb_fill_interrupt_transfer(transfer, kb->handle, 0x83, malloc(MSG_SIZE), MSG_SIZE, icorcallback, kb, 0);
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        if(libusb_submit_transfer(transfer)){
+            libusb_free_transfer(transfer);
+            continue;
+        }
+        kb->keyint[i] = transfer;
+    }
     struct libusb_transfer* transfer = libusb_alloc_transfer(0);
     libusb_fill_interrupt_transfer(transfer, kb->handle, 0x82, malloc(MSG_SIZE), MSG_SIZE, ihidcallback, kb, 0);
-    libusb_submit_transfer(transfer);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    if(libusb_submit_transfer(transfer)){
+        libusb_free_transfer(transfer);
+        return;
+    }
+    kb->hidint = transfer;
 }
 
 void setinput(usbdevice* kb, int input){
@@ -367,16 +817,259 @@ int usbcmp(libusb_device* dev1, libusb_device* dev2){
     return 0;
 }
 
-void closehandle(usbdevice* kb){
+// Releases a device's interfaces and closes its handle, but keeps the device itself so that it can be opened again
+static void releasehandle(usbdevice* kb){
     libusb_release_interface(kb->handle, 0);
     libusb_release_interface(kb->handle, 1);
     libusb_release_interface(kb->handle, 2);
     libusb_release_interface(kb->handle, 3);
     libusb_close(kb->handle);
     kb->handle = 0;
+}
+
+// Returns 1 if any key input transfers are still in flight
+static int intpending(usbdevice* kb){
+    for(int i = 0; i < INT_COUNT; i++){
+        if(kb->keyint[i])
+            return 1;
+    }
+    return 0;
+}
+
+void closehandle(usbdevice* kb){
+    // Cancel the packet in flight, if any, and stop the input transfers. The input transfers are freed by their callbacks, which clear
+    // their slots.
+    kb->closing = 1;
+    if(kb->ctrl && kb->ctrlbusy)
+        libusb_cancel_transfer(kb->ctrl);
+    for(int i = 0; i < INT_COUNT; i++){
+        if(kb->keyint[i])
+            libusb_cancel_transfer(kb->keyint[i]);
+    }
+    if(kb->hidint)
+        libusb_cancel_transfer(kb->hidint);
+    // Cancelled transfers only come back through libusb's event handling, and never come back at all once the handle is closed, so wait
+    // for them here
+    while(kb->ctrlbusy || kb->hidint || intpending(kb)){
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(0, &tv, 0);
+    }
+    // Delete USB queue
+    if(kb->ctrl)
+        libusb_free_transfer(kb->ctrl);
+    kb->ctrl = 0;
+    free(kb->queue);
+    free(kb->frames);
+    kb->queue = 0;
+    kb->frames = 0;
+    releasehandle(kb);
     kb->dev = 0;
 }
 
+// Pipe used by setup threads to tell the main loop they're done
+static int devpipe[2] = { -1, -1 };
+
+// Sets a device's setup state from its setup thread
+static void setupstate(usbdevice* kb, int state){
+    __atomic_store_n(&kb->state, state, __ATOMIC_RELEASE);
+}
+
+// Checks whether a device was unplugged while its setup thread was running
+static int wasremoved(usbdevice* kb){
+    return __atomic_load_n(&kb->removed, __ATOMIC_ACQUIRE);
+}
+
+// Reads the device name and serial number. Returns 0 on success
+static int readstrings(usbdevice* kb){
+    if(libusb_get_string_descriptor_ascii(kb->handle, kb->descriptor.iProduct, (unsigned char*)kb->name, NAME_LEN) <= 0
+            || libusb_get_string_descriptor_ascii(kb->handle, kb->descriptor.iSerialNumber, (unsigned char*)kb->setting.serial, SERIAL_LEN) <= 0)
+        return -1;
+    return 0;
+}
+
+// Opens, resets, and identifies a device, then creates its input device. Runs on the setup thread. Returns 0 on success
+static int opendevice(int index){
+    usbdevice* kb = keyboard + index;
+    int devreset = 0;
+    while(1){
+        if(wasremoved(kb))
+            return -1;
+        if(libusb_open(kb->dev, &kb->handle)){
+            printf("Error: Failed to open USB device\n");
+            kb->handle = 0;
+            return -1;
+        }
+#ifdef OS_LINUX
+        // Claim the USB interfaces.
+        libusb_set_auto_detach_kernel_driver(kb->handle, 1);
+        // 0 is useless (but claim it anyway for completeness)
+        if(libusb_claim_interface(kb->handle, 0))
+            printf("Warning: Failed to claim interface 0\n");
+        // 1 is for HID inputs
+        if(libusb_claim_interface(kb->handle, 1)){
+            printf("Error: Failed to claim interface 1\n");
+            return -1;
+        }
+        // 2 is for Corsair inputs
+        if(libusb_claim_interface(kb->handle, 2)){
+            printf("Error: Failed to claim interface 2\n");
+            return -1;
+        }
+        // 3 is for the LED and board controller
+        if(libusb_claim_interface(kb->handle, 3)){
+            printf("Error: Failed to claim interface 3\n");
+            return -1;
+        }
+        setupstate(kb, DEV_CLAIMED);
+        // Reset the device. It acts weird if you don't.
+        if(devreset < 2){
+            printf("Resetting device\n");
+            int reset = libusb_reset_device(kb->handle);
+            if(reset){
+                releasehandle(kb);
+                if(reset != LIBUSB_ERROR_NOT_FOUND){
+                    printf("Error: Reset failed\n");
+                    return -1;
+                }
+                devreset++;
+                continue;
+            }
+        }
+        setupstate(kb, DEV_RESET);
+#endif
+        // Get device description and serial
+        if(readstrings(kb)){
+            // If it fails, try to reset the device again
+            printf("%s: Failed to get device info%s\n", devreset >= 2 ? "Error" : "Warning", devreset >= 2 ? "" : ", trying to reset...");
+            if(devreset >= 2)
+                return -1;
+            int reset = libusb_reset_device(kb->handle);
+            if(reset){
+                releasehandle(kb);
+                if(reset != LIBUSB_ERROR_NOT_FOUND){
+                    printf("Error: Reset failed\n");
+                    return -1;
+                }
+                devreset++;
+                continue;
+            }
+            if(readstrings(kb)){
+                printf("Error: Reset failed\n");
+                return -1;
+            }
+            printf("Reset success\n");
+        }
+        break;
+    }
+    setupstate(kb, DEV_IDENTIFIED);
+    printf("Connecting %s (S/N: %s)\n", kb->name, kb->setting.serial);
+#ifdef OS_MAC
+    // OSX has some problems sending packets to the device immediately
+    sleep(1);
+#endif
+    if(wasremoved(kb))
+        return -1;
+
+    // Set up an input device for key events
+    if(!inputopen(index, &kb->descriptor))
+        return -1;
+    setupstate(kb, DEV_INPUT);
+    return 0;
+}
+
+// Setup thread. Brings the device up as far as DEV_INPUT and then hands it back to the main loop.
+static void* openthread(void* context){
+    int index = (int)(intptr_t)context;
+    usbdevice* kb = keyboard + index;
+    kb->openerror = (opendevice(index) != 0);
+    unsigned char message = index;
+    if(write(devpipe[1], &message, 1) != 1)
+        printf("Error: Failed to finish setting up device %d: %s\n", index, strerror(errno));
+    return 0;
+}
+
+// Throws away a device that couldn't be set up
+static void opendiscard(int index){
+    usbdevice* kb = keyboard + index;
+    inputclose(index);
+    if(kb->queue)
+        closehandle(kb);
+    else if(kb->handle)
+        releasehandle(kb);
+    memset(kb, 0, sizeof(*kb));
+}
+
+void openfinish(int index){
+    usbdevice* kb = keyboard + index;
+    if(!kb->opening)
+        return;
+    pthread_join(kb->thread, 0);
+    kb->opening = 0;
+    if(kb->openerror || kb->removed){
+        if(!kb->openerror)
+            printf("Device removed during setup\n");
+        opendiscard(index);
+        return;
+    }
+    // From here on the device belongs to the main thread
+    kb->state = DEV_PROFILE;
+
+    // Create the USB queue and the transfer used to send it
+    kb->queue = malloc(QUEUE_LEN * sizeof(usbpacket));
+    kb->queuehead = kb->queuetail = 0;
+    kb->frames = malloc(3 * sizeof(kb->frames[0]));
+    kb->framewrite = 0;
+    kb->framesend = 1;
+    kb->framenext = 2;
+    kb->framepos = -1;
+    kb->ctrl = libusb_alloc_transfer(0);
+    kb->ctrl->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + MSG_SIZE);
+    kb->ctrl->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+#ifdef OS_LINUX
+    // Watch the event device for indicator changes
+    loopadd(kb->event, LP_EVENT, index);
+#endif
+    updateindicators(kb, 1);
+
+    // Make /dev path
+    if(makedevpath(index)){
+        opendiscard(index);
+        return;
+    }
+
+    // Put the M-keys (K95) as well as the Brightness/Lock keys into software-controlled mode. This packet disables their
+    // hardware-based functions.
+    unsigned char datapkt[64] = { 0x07, 0x04, 0x02 };
+    usbqueue(kb, datapkt, 1);
+    // Set all keys to use the Corsair input. HID input is unused.
+#ifdef OS_LINUX
+    setinput(kb, IN_CORSAIR);
+#else
+    setinput(kb, IN_HID);
+#endif
+
+    // Setup the interrupt handler. These have to be processed asychronously so as not to lock up the animation
+    setint(kb);
+
+    // Restore profile (if any). The device keeps the only copy while it's plugged in.
+    storenode* node = addnode(kb->setting.serial);
+    node->kb = kb;
+    usbsetting* store = &node->setting;
+    if(store->profile.modecount){
+        memcpy(&kb->setting.profile, &store->profile, sizeof(store->profile));
+        memset(&store->profile, 0, sizeof(store->profile));
+        updateleds(kb);
+        devlive(kb);
+    } else {
+        // If there is no profile, load it from the device. The device goes live, and its lighting is sent, once it's loaded.
+        kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+        getusbmode(1, &kb->setting.profile);
+        getusbmode(2, &kb->setting.profile);
+        hwloadprofile(kb);
+    }
+}
+
 int openusb(libusb_device* device){
     // Get info and check the manufacturer/product ID
     struct libusb_device_descriptor descriptor;
@@ -394,148 +1087,41 @@ int openusb(libusb_device* device){
             return 0;
     } else
         return 0;
-    // Make sure it's not connected yet
+    // Make sure it's not connected yet. Devices that were unplugged during setup don't count (they may be back after a reset).
     for(int i = 1; i < DEV_MAX; i++){
-        if(!usbcmp(keyboard[i].dev, device)){
+        if(!keyboard[i].removed && !usbcmp(keyboard[i].dev, device)){
             printf("Already connected\n");
             return 0;
         }
     }
+    // Create the pipe used to hear back from the setup threads
+    if(devpipe[0] < 0){
+        if(pipe(devpipe)){
+            printf("Error: Failed to create device pipe: %s\n", strerror(errno));
+            return -1;
+        }
+        fcntl(devpipe[0], F_SETFL, O_NONBLOCK);
+        loopadd(devpipe[0], LP_DEVICE, 0);
+    }
     // Find a free USB slot
-    libusb_ref_device(device);
-    int devreset = 0;
     for(int index = 1; index < DEV_MAX; index++){
         usbdevice* kb = keyboard + index;
-        if(!kb->handle){
-            // Open device
+        if(kb->state == DEV_NONE){
+            libusb_ref_device(device);
             memcpy(&kb->descriptor, &descriptor, sizeof(descriptor));
             kb->dev = device;
             kb->model = model;
-            if(libusb_open(device, &kb->handle)){
-                printf("Error: Failed to open USB device\n");
-                kb->dev = 0;
-                return -1;
-            }
-#ifdef OS_LINUX
-            // Claim the USB interfaces.
-            libusb_set_auto_detach_kernel_driver(kb->handle, 1);
-            // 0 is useless (but claim it anyway for completeness)
-            if(libusb_claim_interface(kb->handle, 0))
-                printf("Warning: Failed to claim interface 0\n");
-            // 1 is for HID inputs
-            if(libusb_claim_interface(kb->handle, 1)){
-                printf("Error: Failed to claim interface 1\n");
-                closehandle(kb);
-                return -1;
-            }
-            // 2 is for Corsair inputs
-            if(libusb_claim_interface(kb->handle, 2)){
-                printf("Error: Failed to claim interface 2\n");
-                closehandle(kb);
+            kb->state = DEV_OPEN;
+            kb->opening = 1;
+            // Resetting the device and creating the input device take a while, so do it on another thread. The main loop picks the
+            // device up again in openfinish().
+            int error = pthread_create(&kb->thread, 0, openthread, (void*)(intptr_t)index);
+            if(error){
+                printf("Error: Failed to start setup thread: %s\n", strerror(error));
+                libusb_unref_device(device);
+                memset(kb, 0, sizeof(*kb));
                 return -1;
             }
-            // 3 is for the LED and board controller
-            if(libusb_claim_interface(kb->handle, 3)){
-                printf("Error: Failed to claim interface 3\n");
-                closehandle(kb);
-                return -1;
-            }
-            // Reset the device. It acts weird if you don't.
-            if(devreset < 2){
-                printf("Resetting device\n");
-                int reset = libusb_reset_device(kb->handle);
-                if(reset){
-                    closehandle(kb);
-                    if(reset != LIBUSB_ERROR_NOT_FOUND){
-                        printf("Error: Reset failed\n");
-                        return -1;
-                    }
-                    index--;
-                    devreset++;
-                    continue;
-                }
-            }
-#endif
-            // Get device description and serial
-            if(libusb_get_string_descriptor_ascii(kb->handle, descriptor.iProduct, (unsigned char*)kb->name, NAME_LEN) <= 0
-                    || libusb_get_string_descriptor_ascii(kb->handle, descriptor.iSerialNumber, (unsigned char*)kb->setting.serial, SERIAL_LEN) <= 0){
-                // If it fails, try to reset the device again
-                printf("%s: Failed to get device info%s\n", devreset >= 2 ? "Error" : "Warning", devreset >= 2 ? "" : ", trying to reset...");
-                if(devreset < 2){
-                    int reset = libusb_reset_device(kb->handle);
-                    if(reset){
-                        closehandle(kb);
-                        if(reset != LIBUSB_ERROR_NOT_FOUND){
-                            printf("Error: Reset failed\n");
-                            return -1;
-                        }
-                        index--;
-                        devreset++;
-                        continue;
-                    }
-                    if(libusb_get_string_descriptor_ascii(kb->handle, descriptor.iProduct, (unsigned char*)kb->name, NAME_LEN) <= 0
-                            || libusb_get_string_descriptor_ascii(kb->handle, descriptor.iSerialNumber, (unsigned char*)kb->setting.serial, SERIAL_LEN) <= 0){
-                        printf("Error: Reset failed\n");
-                        return -1;
-                    }
-                    printf("Reset success\n");
-                } else
-                    return -1;
-            }
-            printf("Connecting %s (S/N: %s)\n", kb->name, kb->setting.serial);
-#ifdef OS_MAC
-            // OSX has some problems sending packets to the device immediately
-            sleep(1);
-#endif
-
-            // Set up an input device for key events
-            if(!inputopen(index, &descriptor)){
-                closehandle(kb);
-                return -1;
-            }
-            updateindicators(kb, 1);
-
-            // Make /dev path
-            if(makedevpath(index)){
-                inputclose(index);
-                closehandle(kb);
-                return -1;
-            }
-
-            // Create the USB queue
-            for(int q = 0; q < QUEUE_LEN; q++)
-                kb->queue[q] = malloc(MSG_SIZE);
-
-            // Put the M-keys (K95) as well as the Brightness/Lock keys into software-controlled mode. This packet disables their
-            // hardware-based functions.
-            unsigned char datapkt[64] = { 0x07, 0x04, 0x02 };
-            usbqueue(kb, datapkt, 1);
-            // Set all keys to use the Corsair input. HID input is unused.
-#ifdef OS_LINUX
-            setinput(kb, IN_CORSAIR);
-#else
-            setinput(kb, IN_HID);
-#endif
-
-            // Setup the interrupt handler. These have to be processed asychronously so as not to lock up the animation
-            setint(kb);
-
-            // Restore profile (if any)
-            usbsetting* store = findstore(kb->setting.serial);
-            if(store){
-                memcpy(&kb->setting.profile, &store->profile, sizeof(store->profile));
-            } else {
-                // If there is no profile, load it from the device
-                kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
-                getusbmode(1, &kb->setting.profile);
-                getusbmode(2, &kb->setting.profile);
-                hwloadprofile(kb);
-            }
-            updateleds(kb);
-
-            updateconnected();
-
-            printf("Device ready at %s%d\n", devpath, index);
             return 0;
         }
     }
@@ -544,22 +1130,47 @@ int openusb(libusb_device* device){
     return -1;
 }
 
+void closeremoved(){
+    for(int i = 1; i < DEV_MAX; i++){
+        usbdevice* kb = keyboard + i;
+        if(kb->removed && !kb->opening && kb->state >= DEV_PROFILE)
+            closeusb(i);
+    }
+}
+
 int closeusb(int index){
-    // Close file handles
     usbdevice* kb = keyboard + index;
+    if(kb->opening){
+        // The setup thread still owns the device. Let it finish and throw the device away afterward.
+        __atomic_store_n(&kb->removed, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    // Close file handles
     if(!kb->fifo)
         return 0;
+    loopdel(kb->fifo);
     close(kb->fifo);
     kb->fifo = 0;
-    if(kb->handle){
+    linefree(&kb->fifoin);
+    sockclose(index);
+    if(kb->rgbfifo){
+        loopdel(kb->rgbfifo);
+        close(kb->rgbfifo);
+        kb->rgbfifo = 0;
+    }
+    if(kb->fbfd){
+        close(kb->fbfd);
+        kb->fbfd = 0;
+    }
+    free(kb->held);
+    if(kb->state >= DEV_PROFILE){
         printf("Disconnecting %s (S/N: %s)\n", kb->name, kb->setting.serial);
         inputclose(index);
-        // Delete USB queue
-        for(int i = 0; i < QUEUE_LEN; i++)
-            free(kb->queue[i]);
         // Move the profile data into the device store
-        usbsetting* store = addstore(kb->setting.serial);
-        memcpy(&store->profile, &kb->setting.profile, sizeof(kb->setting.profile));
+        storenode* node = addnode(kb->setting.serial);
+        memcpy(&node->setting.profile, &kb->setting.profile, sizeof(kb->setting.profile));
+        node->kb = 0;
+        storechanged();
         // Reset and close USB device
         libusb_reset_device(kb->handle);
         closehandle(kb);
@@ -39,14 +39,44 @@ typedef struct {
 
 // End key bind structures
 
-// Lighting structure for a device/profile
+// Lighting structure for a device/profile. Colors are kept at 8 bits per channel for each LED and reduced to the hardware's 3 bits when
+// they're sent.
 typedef struct {
-    char r[N_KEYS / 2];
-    char g[N_KEYS / 2];
-    char b[N_KEYS / 2];
+    unsigned char r[N_KEYS];
+    unsigned char g[N_KEYS];
+    unsigned char b[N_KEYS];
     char enabled;
 } keylight;
 
+// Lighting layer. A mode's layers are drawn over its own lighting in order, bottom first.
+#define LAYER_MAX       8
+#define BLEND_REPLACE   0   // Replaces the color below wherever alpha is nonzero
+#define BLEND_ALPHA     1   // Mixed with the color below by alpha
+#define BLEND_ADD       2   // Added to the color below
+#define BLEND_MULTIPLY  3   // Multiplied with the color below
+typedef struct {
+    // Color and alpha of each key, in keymap order
+    unsigned char rgba[N_KEYS][4];
+    // Opacity of the whole layer. Each key's alpha is scaled by this.
+    unsigned char opacity;
+    char blend;
+} keylayer;
+
+// Layer stack for a mode. The composited lighting is only recalculated for keys whose color might have changed.
+typedef struct {
+    // Layers, bottom first. Allocated when the first one is added.
+    keylayer* layer;
+    int count;
+    // Keys that need to be composited again (one bit per key), and whether any bits are set
+    unsigned char dirty[N_KEYS / 8];
+    char anydirty;
+    // Mode lighting with the layers drawn over it, and the lighting they were drawn over (only compared, never read, since it may be
+    // gone). reset is set if the composite needs to be copied from the lighting below again.
+    keylight composite;
+    const keylight* base;
+    char reset;
+} layerstack;
+
 // ID structure
 typedef struct {
     char guid[16];
@@ -57,6 +87,7 @@ typedef struct {
 #define MD_NAME_LEN 16
 typedef struct {
     keylight light;
+    layerstack layers;
     keybind bind;
     unsigned short name[MD_NAME_LEN];
     usbid id;
@@ -74,31 +105,206 @@ typedef struct {
 } usbprofile;
 #define MODE_MAX    16
 
+// Copy of the profile last read from a keyboard's hardware. If the profile and mode IDs read from the keyboard still match, the rest of
+// the profile doesn't need to be read again.
+#define HW_MODES    3
+typedef struct {
+    usbid id;
+    unsigned short name[PR_NAME_LEN];
+    usbid modeid[HW_MODES];
+    unsigned short modename[HW_MODES][MD_NAME_LEN];
+    keylight light[HW_MODES];
+    char valid;
+} hwprofile;
+
 // Structure to store settings for a USB device, whether or not it's plugged in
 #define SERIAL_LEN  33
 typedef struct {
     usbprofile profile;
+    // Hardware profile cache. Only the copy in the device store is used.
+    hwprofile hw;
     char serial[SERIAL_LEN];
 } usbsetting;
 
+// USB packet types
+#define PK_CTRL     0   // Message for the LED/board controller. These are never dropped
+#define PK_FRAME    1   // Lighting frame marker. The frame itself is kept in the device's frame buffers
+#define PK_IND      2   // Indicator LED state (1 byte, sent to the HID interface)
+#define PK_REQ      3   // Hardware profile request. These are sent back-to-back. If the tag is nonzero, the response is read back.
+
+// Hardware request tags. The mode is stored in bits 4-7 and the LED packet number in bits 0-3.
+#define HWT_PROFILEID   0x100
+#define HWT_MODEID      0x200
+#define HWT_PROFILENAME 0x300
+#define HWT_MODENAME    0x400
+#define HWT_LEDS        0x500
+#define HWT_KIND        0xf00
+
+// USB output packet
+#define MSG_SIZE    64
+typedef struct {
+    unsigned char data[MSG_SIZE];
+    char type;
+    short tag;
+} usbpacket;
+
+// Line reader for command input. Each command source has its own, so partial lines from different sources never get mixed together.
+#define LINE_BUFFER (16 * 1024)
+typedef struct {
+    char* buffer;
+    // Data read but not yet returned as a line
+    int start, end;
+    // Set while discarding a line that didn't fit in the buffer
+    char skipping;
+} linereader;
+
+#define RGB_FRAME_LEN   (N_KEYS * 3)    // Size of a lighting frame in RGB888 format
+
+// Shared lighting framebuffer (ckbN/framebuffer). Clients map the file, make the sequence number odd, write the colors, and then make it
+// even again. The daemon only shows a frame if the sequence number was even and unchanged while it was being copied. The daemon reads the
+// file rather than mapping it, since any client can resize it.
+typedef struct {
+    unsigned int sequence;
+    unsigned char rgb[RGB_FRAME_LEN];
+} ledframebuffer;
+
+// Lighting effect rendered by the daemon on each frame (see effect.h)
+#define FX_NONE     0
+#define FX_SOLID    1
+#define FX_GRADIENT 2
+#define FX_WAVE     3
+#define FX_RIPPLE   4
+#define FX_RANDOM   5
+typedef struct {
+    char type;
+    // Foreground and background colors
+    float fg[3], bg[3];
+    // Effect progress: position of the wave or ring, amount of foreground left in the gradient, or seconds into the current random fade
+    float pos;
+    // Time of the last frame, in nanoseconds (0 if nothing has been drawn yet)
+    long long lasttime;
+    // Random effect colors at the start and end of the current fade
+    unsigned char from[RGB_FRAME_LEN], to[RGB_FRAME_LEN];
+    // Lighting drawn by the effect. While shown is set it's displayed instead of the current mode's own lighting (the mode's layers are
+    // still drawn over it), so the mode's colors are left as they were.
+    keylight light;
+    char shown;
+} lighteffect;
+
+// Reactive lighting, drawn on a layer of the current mode as keys are pressed (see effect.h)
+#define RX_NONE     0
+#define RX_FLASH    1   // Pressed keys light up, then fade out after they're released
+#define RX_RIPPLE   2   // Each keypress sends out a ring from the key
+#define RIPPLE_MAX  8
+typedef struct {
+    char type;
+    // Layer to draw on, and whether it was selected with the layer command. If not, the layer was added for reactive lighting, and a new
+    // one is added on each mode it moves to.
+    char layer;
+    char picked;
+    unsigned char color[3];
+    // Brightness of each key's flash, from 0 to 1
+    float level[N_KEYS];
+    // Center and radius of each ripple
+    struct {
+        short x, y;
+        float radius;
+    } ripple[RIPPLE_MAX];
+    int ripplecount;
+    // Set if anything was lit in the last frame drawn
+    char lit;
+    // Time of the last frame, in nanoseconds
+    long long lasttime;
+} reactlight;
+
+// Latency histogram, in nanoseconds. Each power of two is split into 8 buckets, so values are kept to within 12.5%. Updates are atomic, so
+// it can be read and reset without stopping the thread that writes it.
+#define HIST_SUB        8
+#define HIST_BUCKETS    (30 * HIST_SUB)     // Up to about 4 seconds
+typedef struct {
+    unsigned int bucket[HIST_BUCKETS];
+    unsigned long long count;
+    long long max;
+} latencyhist;
+// Adds a time to a histogram
+void histadd(latencyhist* hist, long long ns);
+// Gets the time below which a fraction (0 to 1) of the values in a histogram fall. Returns 0 if it's empty.
+long long histpercentile(const latencyhist* hist, float fraction);
+// Clears a histogram
+void histreset(latencyhist* hist);
+
+// USB and frame statistics for a device, written to its stats node once per second
+#define LATENCY_BUCKETS 8   // Control transfer latency histogram: under 1ms, 2ms, 4ms, ... 64ms, and anything longer
+typedef struct {
+    // Packets sent successfully, dropped because the queue was full, failed, and timed out
+    unsigned long long sent, dropped, errors, timeouts;
+    // Lighting frames delivered, and frames replaced by a newer one before they could be sent
+    unsigned long long frames, replaced;
+    // Most packets waiting in the queue at once
+    unsigned int queuemax;
+    // Time from submitting each control transfer to its completion
+    unsigned long long latency[LATENCY_BUCKETS];
+    // Key reports processed, and interrupt transfers lost
+    unsigned long long inputs, inputerrors;
+    // Time from receiving each key report to having written all of its events
+    latencyhist inputlatency;
+    // Time the current control transfer was submitted
+    long long ctrlstart;
+    // Time of the last stats update, the frame count at that time, and the frame rate since the update before it
+    long long updatetime;
+    unsigned long long updateframes;
+    float fps;
+} usbstats;
+
 // Structure for tracking keyboard devices
 #define NAME_LEN    33
-#define QUEUE_LEN   40
-#define MSG_SIZE    64
+#define INT_COUNT   4       // Interrupt transfers kept in flight for key input
+#define QUEUE_LEN   256     // Must be a power of two
+#define FRAME_LEN   5       // Packets per lighting frame
+#define FRAME_INDEX 3       // Frame buffer index mask (see framenext)
+#define FRAME_FRESH 4       // Set in framenext when it holds a frame that hasn't been sent yet
 typedef struct {
     // USB device info
     struct libusb_device_descriptor descriptor;
     libusb_device* dev;
     libusb_device_handle* handle;
     int model;
-    // Interrupt transfers
-    struct libusb_transfer* keyint;
+    // Interrupt transfers. Several are kept in flight so that a report can always be received while the last one is being processed.
+    // Each has its own buffer, which is copied into intinput when it completes. A slot is cleared when its transfer is freed.
+    struct libusb_transfer* keyint[INT_COUNT];
+    // HID interrupt transfer. Its reports aren't used; it's only kept so that it can be stopped when the device closes.
+    struct libusb_transfer* hidint;
     unsigned char intinput[MSG_SIZE];
     unsigned char previntinput[N_KEYS / 8];
     // Indicator LED state
     unsigned char ileds;
     // Command FIFO
     int fifo;
+    linereader fifoin;
+    // Set when commands have changed the lighting but it hasn't been sent yet
+    char ledsdirty;
+    // Command source (see SRC_CLIENT/SRC_FIFO) inside a begin/commit block, or 0 if none, and the time the block began
+    int batching;
+    long long batchtime;
+    // Control socket (Linux only)
+    int sock;
+    // Binary lighting FIFO
+    int rgbfifo;
+    // Set if the last batch read from the FIFO was made of whole frames (see readrgbframe)
+    char rgbsync;
+    // Shared framebuffer file, and the sequence number of the last frame taken from it
+    int fbfd;
+    unsigned int fbsequence;
+    // Running lighting effect
+    lighteffect effect;
+    reactlight reactive;
+    // Set if the lighting is dithered. Each frame then rounds the colors up or down so that over time they average out to their 8-bit
+    // values, and the rounding error left over for each LED is carried to the next frame. Only frames that reach the device count:
+    // dithererror is what the last one sent left over, and ditherpending is what the frame waiting to be sent will leave if it isn't
+    // replaced first (if ditherqueued is set). Owned by the producer.
+    char dither;
+    char ditherqueued;
+    short dithererror[3][N_KEYS], ditherpending[3][N_KEYS];
     // uinput/event devices
 #ifdef OS_LINUX
     int uinput;
@@ -108,13 +314,56 @@ typedef struct {
     CGEventSourceRef event;
     CGEventFlags eflags;
 #endif
-    // USB output queue
-    unsigned char* queue[QUEUE_LEN];
-    int queuecount;
+    // USB output queue (ring buffer of QUEUE_LEN packets). The head is written by the producer, the tail by the consumer.
+    usbpacket* queue;
+    unsigned int queuehead, queuetail;
+    // Lighting frames are triple-buffered so that a new frame can replace one that's still waiting to be sent. The producer writes
+    // frames[framewrite], the consumer sends frames[framesend], and framenext holds the latest finished frame (plus FRAME_FRESH if it's
+    // waiting to be sent). framepos is the next packet of the frame being sent, or -1 if none.
+    unsigned char (*frames)[FRAME_LEN][MSG_SIZE];
+    int framewrite, framesend, framenext;
+    int framepos;
+    // Last lighting frame queued. Owned by the producer, except that lastvalid is also cleared when a frame doesn't make it to the
+    // device, so that the same frame can be queued again.
+    unsigned char lastframe[FRAME_LEN][MSG_SIZE];
+    char lastvalid;
+    // Statistics. Only touched from the main thread.
+    usbstats stats;
+    // Transfer used to send the queue. Only one message is in flight at a time
+    struct libusb_transfer* ctrl;
+    char ctrlbusy;
+    // Set while the response to a hardware request is being read
+    char ctrlread;
+    // Hardware profile load stage (HW_IDLE, HW_IDS, HW_DATA) and number of responses left in the stage
+    char hwload;
+    int hwpending;
+    // Set while every response in the load has arrived. During the ID stage, also requires the IDs to match the cached profile.
+    char hwok;
+    // Profile being loaded. Responses are collected here and the profile is updated from it in one step when the load finishes.
+    hwprofile hwstage;
+    // Commands that arrived during a hardware load, run once it has finished (see cmdhold). Each is the source as an int followed by the
+    // line. The newest rgbframe frame from the same time is kept in heldframe if rgbheld is set.
+    char* held;
+    int heldlen;
+    unsigned char heldframe[RGB_FRAME_LEN];
+    char rgbheld;
     // Keyboard settings
     usbsetting setting;
     // Device name
     char name[NAME_LEN];
+    // Setup state (DEV_*). Until the state reaches DEV_INPUT, the device belongs to its setup thread and the main thread may only touch the
+    // fields below.
+    int state;
+    pthread_t thread;
+    // Set while the setup thread is running or hasn't been joined yet
+    char opening;
+    // Set if the device was unplugged. A device that's unplugged during setup is thrown away when setup finishes; otherwise it's closed by
+    // closeremoved().
+    char removed;
+    // Set while the device is being closed. Transfer callbacks then leave the device alone.
+    char closing;
+    // Set by the setup thread if it failed
+    char openerror;
 } usbdevice;
 #define DEV_MAX     10
 extern usbdevice keyboard[DEV_MAX];
@@ -123,8 +372,23 @@ extern usbdevice keyboard[DEV_MAX];
 int usbcmp(libusb_device* dev1, libusb_device* dev2);
 // Open a USB device and create a new device entry. Returns 0 on success
 int openusb(libusb_device* device);
-// Close a USB device and remove device entry. Returns 0 on success
+// Finish setting up a device after its setup thread is done. Called from the main loop.
+void openfinish(int index);
+// Close a USB device and remove device entry. Returns 0 on success. Closing a device waits for its transfers to come back, so this must
+// not be called from a libusb callback.
 int closeusb(int index);
+// Closes every device that has been marked as removed. Called from the main loop.
+void closeremoved();
+
+// Device setup states. The first few are handled by a setup thread so that other devices keep running while a new one is connected.
+#define DEV_NONE        0   // Slot is unused
+#define DEV_OPEN        1   // Setup thread started
+#define DEV_CLAIMED     2   // Interfaces claimed
+#define DEV_RESET       3   // Device reset
+#define DEV_IDENTIFIED  4   // Name and serial read
+#define DEV_INPUT       5   // Input device ready. Setup continues on the main thread from here
+#define DEV_PROFILE     6   // Queue running, waiting for the profile to load
+#define DEV_LIVE        7   // Fully connected
 
 // Set input mode on a device
 #define IN_CORSAIR  0x40
@@ -133,15 +397,35 @@ void setinput(usbdevice* kb, int input);
 
 // Add a message to a USB device to be sent to the device. Returns 0 on success.
 int usbqueue(usbdevice* kb, unsigned char* messages, int count);
-// Output a message from the USB queue to the device, if any. Returns number of bytes written.
+// Add a lighting frame to the USB queue. If a frame is already waiting to be sent, it is replaced by this one. Frames that are identical
+// to the last one queued are ignored.
+void usbqueueframe(usbdevice* kb, unsigned char frame[FRAME_LEN][MSG_SIZE]);
+// Returns 1 if a lighting frame is waiting in the queue and hasn't been taken for sending yet
+int usbframewaiting(usbdevice* kb);
+// Add a hardware request to the USB queue. If tag is nonzero, the device's response will be read and handled according to the tag.
+// Returns 0 on success.
+int usbqueuereq(usbdevice* kb, unsigned char* message, int tag);
+// Add an indicator LED update to the USB queue. Returns 0 on success.
+int usbqueueind(usbdevice* kb, unsigned char ileds);
+// Get the number of packets waiting to be sent
+int usbpending(usbdevice* kb);
+// Output a message from the USB queue to the device, if any. The message is removed from the queue when the transfer completes.
+// Returns number of bytes submitted, or 0 if nothing was sent (queue empty or a message is already in flight).
 int usbdequeue(usbdevice* kb);
+// Sends everything in the USB queue and waits for it to finish. Must not be called from a libusb callback.
+void usbflush(usbdevice* kb);
 
 // Find a connected USB device. Returns 0 if not found
 usbdevice* findusb(const char* serial);
+// Number of devices in storage. Every device that has been plugged in has an entry, though a device's settings are kept in the device
+// itself while it's plugged in.
+extern int storecount;
 // Find a USB device from storage. Returns 0 if not found
 usbsetting* findstore(const char* serial);
-// Add a USB device to storage. Returns an existing device if found or a new one if not.
+// Add a USB device to storage. Returns an existing device if found or a new one if not. The address stays valid as devices are added.
 usbsetting* addstore(const char* serial);
+// Gets the device in storage after prev, or the first one if prev is null. Returns 0 after the last device.
+usbsetting* storenext(usbsetting* prev);
 
 // Get a mode from a profile. The mode will be created if it didn't already exist.
 usbmode* getusbmode(int id, usbprofile* profile);
@@ -160,9 +444,17 @@ void genid(usbid* id);
 // Updates an ID's modification
 void updatemod(usbid* id);
 
-// Loads the profile name from hardware
+// Hardware load stages
+#define HW_IDLE     0
+#define HW_IDS      1   // Reading profile/mode IDs
+#define HW_DATA     2   // Reading names and lighting
+
+// Loads the profile from hardware. This happens asynchronously; the device's lighting is updated when it's finished. Commands and
+// lighting frames sent to the device in the meantime are held until then.
 void hwloadprofile(usbdevice* kb);
 // Saves the profile name to hardware
 void hwsaveprofile(usbdevice* kb);
+// Handles the response to a hardware request made by hwloadprofile(). data is null if the request failed. Called by the USB queue.
+void hwresponse(usbdevice* kb, int tag, const unsigned char* data);
 
 #endif
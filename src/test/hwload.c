@@ -0,0 +1,95 @@
+// Checks that commands and lighting frames sent during a hardware profile load are applied after it instead of being overwritten by it.
+// Build and run with "make test".
+#include "../ckb-daemon/devnode.h"
+#include "../ckb-daemon/keyboard.h"
+
+static int failures = 0;
+static int fd[2];
+static usbdevice* kb;
+static int escled;
+
+// Runs a command line
+static void command(const char* text){
+    char line[256];
+    snprintf(line, sizeof(line), "%s", text);
+    readcmd(kb, line, SRC_FIFO(1));
+}
+
+// Checks the red level of the Esc key in a mode
+static void expect(const char* name, int mode, int value){
+    int shown = kb->setting.profile.mode[mode].light.r[escled];
+    if(shown != value){
+        printf("FAIL %s: shown %02x, expected %02x\n", name, shown, value);
+        failures++;
+    } else
+        printf("ok   %s\n", name);
+}
+
+// Answers every request of a K70 profile load. The IDs never match, so the names and lighting are read too. The lighting packets hold
+// level, which is shown as (7 - level) * 255 / 7.
+static void answerload(int level){
+    unsigned char data[MSG_SIZE] = { 0 };
+    hwresponse(kb, HWT_PROFILEID, data);
+    hwresponse(kb, HWT_MODEID, data);
+    hwresponse(kb, HWT_PROFILENAME, data);
+    hwresponse(kb, HWT_MODENAME, data);
+    memset(data + 4, level | level << 4, MSG_SIZE - 4);
+    for(int i = 1; i <= 4; i++)
+        hwresponse(kb, HWT_LEDS | i, data);
+}
+
+int main(){
+    // A K70 that's plugged in as far as the commands are concerned. Nothing is sent to it, since it has no USB queue.
+    kb = keyboard + 1;
+    kb->handle = (libusb_device_handle*)kb;
+    kb->model = 70;
+    kb->state = DEV_LIVE;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+    escled = keymap[findkey("esc", 3)].led;
+    if(pipe(fd)){
+        printf("Error: Unable to create pipe\n");
+        return 1;
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    kb->rgbfifo = fd[0];
+    kb->rgbsync = 1;
+
+    // A load on its own replaces the lighting, but only once it's finished
+    command("rgb 100000");
+    command("hwload");
+    expect("load in progress", 0, 0x10);
+    answerload(7);
+    expect("load finished", 0, 0x00);
+
+    // A command sent during the load
+    command("hwload");
+    command("rgb esc:200000");
+    expect("command during load", 0, 0x00);
+    answerload(0);
+    expect("command after load", 0, 0x20);
+
+    // A command on the same line as hwload, with the mode and layer it selected. Mode 2 isn't stored in a K70, but the command still waits.
+    command("mode 2 rgb 000000 hwload rgb 300000 layer 1 rgb esc:ff000080");
+    expect("same line during load", 1, 0x00);
+    answerload(7);
+    expect("same line after load", 1, 0x30);
+    if(kb->setting.profile.mode[1].layers.count != 1){
+        printf("FAIL same line layer: %d layers, expected 1\n", kb->setting.profile.mode[1].layers.count);
+        failures++;
+    } else
+        printf("ok   same line layer\n");
+
+    // A lighting frame written during the load
+    command("hwload");
+    unsigned char frame[RGB_FRAME_LEN];
+    memset(frame, 0x40, sizeof(frame));
+    if(write(fd[1], frame, sizeof(frame)) != sizeof(frame))
+        printf("Error: Write failed\n");
+    readrgbframe(kb);
+    expect("frame during load", 0, 0x00);
+    answerload(7);
+    expect("frame after load", 0, 0x40);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
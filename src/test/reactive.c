@@ -0,0 +1,76 @@
+// Checks which layers reactive lighting draws on as modes are switched, and that it leaves the modes' own layers alone. Build and run
+// with "make test".
+#include "../ckb-daemon/devnode.h"
+#include "../ckb-daemon/effect.h"
+#include "../ckb-daemon/keyboard.h"
+
+static int failures = 0;
+static usbdevice* kb;
+
+// Runs a command line
+static void command(const char* text){
+    char line[256];
+    snprintf(line, sizeof(line), "%s", text);
+    readcmd(kb, line, SRC_FIFO(1));
+}
+
+static void expect(const char* name, int value, int expected){
+    if(value != expected){
+        printf("FAIL %s: %d, expected %d\n", name, value, expected);
+        failures++;
+    } else
+        printf("ok   %s\n", name);
+}
+
+static usbmode* getmode(int index){
+    return kb->setting.profile.mode + index;
+}
+
+int main(){
+    // A device that's plugged in as far as readcmd() is concerned. Nothing is sent to it, since it has no USB queue.
+    kb = keyboard + 1;
+    kb->handle = (libusb_device_handle*)kb;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+    int esc = findkey("esc", 3);
+
+    // Mode 1 has one layer and mode 2 has two. Mode 2's bottom layer has Esc lit; its top layer has nothing at all.
+    command("layer 1 rgb esc:ff000080");
+    command("mode 2 layer 1 rgb esc:00ff00ff layer 2 blend add");
+
+    // Without a layer selected, reactive lighting takes a new one on the current mode, even if another mode was selected first
+    command("mode 2 reactive flash");
+    expect("new layer on the current mode", kb->reactive.layer, 1);
+    expect("current mode's layers", getmode(0)->layers.count, 2);
+    expect("other mode's layers", getmode(1)->layers.count, 2);
+
+    // Switching modes moves it to a new layer on the new mode and removes the one it added
+    command("mode 2 switch");
+    expect("new layer after switch", kb->reactive.layer, 2);
+    expect("old mode's layers after switch", getmode(0)->layers.count, 1);
+    expect("new mode's layers after switch", getmode(1)->layers.count, 3);
+    expect("new mode's own layer kept", getmode(1)->layers.layer[0].rgba[esc][1], 0xff);
+    expect("new mode's own blend kept", getmode(1)->layers.layer[1].blend, BLEND_ADD);
+
+    // Switching back, after a layer was added above the reactive one, leaves that layer in place
+    command("layer 4 rgb esc:0000ff");
+    command("mode 1 switch");
+    expect("layer left under a newer one", getmode(1)->layers.count, 4);
+    expect("new layer after switching back", kb->reactive.layer, 1);
+
+    // A selected layer is used on every mode, and isn't removed
+    command("layer 1 reactive ripple");
+    expect("selected layer", kb->reactive.layer, 0);
+    expect("layers with a selected layer", getmode(0)->layers.count, 1);
+    command("mode 2 switch");
+    expect("selected layer after switch", kb->reactive.layer, 0);
+    expect("new mode's layers with a selected layer", getmode(1)->layers.count, 4);
+
+    // Clearing the current mode's layers gives it a new one
+    command("reactive flash");
+    command("layer clear");
+    expect("layer after clear", kb->reactive.layer, 0);
+    expect("layers after clear", getmode(1)->layers.count, 1);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
@@ -0,0 +1,45 @@
+// Checks that readcmd() takes colors in exactly the formats the README gives and rejects anything else. Build and run with "make test".
+#include "../ckb-daemon/devnode.h"
+#include "../ckb-daemon/keyboard.h"
+
+static int failures = 0;
+static usbdevice* kb;
+
+// Runs a command line and checks how many errors it gave
+static void expect(const char* command, int errors){
+    char line[256];
+    snprintf(line, sizeof(line), "%s", command);
+    int result = readcmd(kb, line, SRC_FIFO(1));
+    if(result != errors){
+        printf("FAIL %s: %d errors, expected %d\n", command, result, errors);
+        failures++;
+    } else
+        printf("ok   %s\n", command);
+}
+
+int main(){
+    // A device that's plugged in as far as readcmd() is concerned. Nothing is sent to it, since cmdflush() is never called.
+    kb = keyboard + 1;
+    kb->handle = (libusb_device_handle*)kb;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+
+    expect("rgb ff0000", 0);
+    expect("rgb esc:ff0000", 0);
+    expect("rgb ff0000zz", 1);
+    expect("rgb ff00001234", 1);
+    expect("rgb ff000", 1);
+    expect("rgb esc:ff0000zz", 1);
+    expect("rgb esc:ff00001234", 1);
+    expect("rgb esc:ff000080", 1);
+
+    // Layers take an alpha value as well, but nothing after it
+    expect("layer 1 rgb ff000080", 0);
+    expect("layer 1 rgb esc:ff000080", 0);
+    expect("layer 1 rgb esc:ff0000", 0);
+    expect("layer 1 rgb esc:ff0000zz", 1);
+    expect("layer 1 rgb esc:ff00008012", 1);
+    expect("layer 1 rgb ff00008012", 1);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}
@@ -0,0 +1,74 @@
+// Checks that the rgbframe FIFO stays in step with the frames written to it, including after a short write. Build and run with "make test".
+#include "../ckb-daemon/devnode.h"
+#include "../ckb-daemon/keyboard.h"
+
+static int failures = 0;
+static int fd[2];
+static usbdevice* kb;
+static int escled;
+
+// Writes a whole frame with every color set to value
+static void writeframe(int value){
+    unsigned char frame[RGB_FRAME_LEN];
+    memset(frame, value, sizeof(frame));
+    if(write(fd[1], frame, sizeof(frame)) != sizeof(frame))
+        printf("Error: Write failed\n");
+}
+
+// Reads the FIFO and checks the color of the Esc key
+static void expect(const char* name, int value){
+    readrgbframe(kb);
+    int shown = (unsigned char)kb->setting.profile.currentmode->light.r[escled];
+    if(shown != value){
+        printf("FAIL %s: shown %02x, expected %02x\n", name, shown, value);
+        failures++;
+    } else
+        printf("ok   %s\n", name);
+}
+
+int main(){
+    // A device with an rgbframe FIFO and nothing else. Frames aren't queued, since it has no USB queue.
+    kb = keyboard + 1;
+    kb->setting.profile.currentmode = getusbmode(0, &kb->setting.profile);
+    if(pipe(fd)){
+        printf("Error: Unable to create pipe\n");
+        return 1;
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    kb->rgbfifo = fd[0];
+    kb->rgbsync = 1;
+    escled = keymap[findkey("esc", 3)].led;
+
+    writeframe(0x10);
+    expect("whole frame", 0x10);
+    writeframe(0x11);
+    writeframe(0x12);
+    expect("newest of two frames", 0x12);
+
+    // A short write, alone and followed by whole frames. Nothing may be shown until the stream is known to be in step again.
+    unsigned char partial[100] = { 0 };
+    write(fd[1], partial, sizeof(partial));
+    expect("short write", 0x12);
+    writeframe(0x20);
+    expect("batch after a short write", 0x12);
+    writeframe(0x21);
+    expect("in step again", 0x21);
+    write(fd[1], partial, sizeof(partial));
+    for(int i = 0; i < 8; i++)
+        writeframe(0x30 + i);
+    expect("short write followed by a burst", 0x21);
+    writeframe(0x40);
+    expect("batch after the burst", 0x21);
+    writeframe(0x41);
+    expect("in step after the burst", 0x41);
+
+    // Several frames in one write
+    unsigned char frames[RGB_FRAME_LEN * 9];
+    for(int i = 0; i < 9; i++)
+        memset(frames + i * RGB_FRAME_LEN, 0x50 + i, RGB_FRAME_LEN);
+    write(fd[1], frames, sizeof(frames));
+    expect("nine frames in one write", 0x58);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures != 0;
+}